@@ -10,6 +10,8 @@ typedef struct {
   Arrivals* next_arrivals;
   bool refresh_arrivals;
   bool initialized;
+  bool arrivals_stale;   // arrivals are from the snapshot, not yet live
+  time_t arrivals_time;  // when the arrivals were fetched
 } AppData;
 
 #endif //APPDATA_H
\ No newline at end of file
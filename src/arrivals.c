@@ -9,38 +9,62 @@ void ListArrivals(const Arrivals* arrivals) {
     Arrival* a = (Arrival*)MemListGet(arrivals, i);
     
     APP_LOG(APP_LOG_LEVEL_INFO, 
-            "%u - index:%u\tdelta:%s\tds:%i",
+            "%u - index:%u\ttrip:%x\tdelta:%i",
             (uint)i, 
             (uint)a->bus_index, 
-            a->delta_string, 
+            (uint)a->trip_id, 
             (int)a->delta);
   }
 #endif
 }
 
-void AddArrival(const char* stop_id,
-                const char* route_id,
-                const char* trip_id,
-                const char* scheduled_string,
-                const char* predicted_string,
-                const char* arrival_string,
+void AddArrival(const uint32_t bus_index,
+                const uint32_t trip_id,
+                const int32_t scheduled,
+                const int32_t predicted,
                 const int32_t arrival_delta,
                 const char arrival_code,
                 const Buses* buses,
                 Arrivals* arrivals) {
 
-  int32_t index = GetBusIndex(stop_id, route_id, buses);
+  // the bus may have been removed since the request was made
+  if(bus_index >= buses->count) {
+    return;
+  }
 
-  if(index < 0) {
+  // an arrival that's already in the list is being updated
+  RemoveArrival(bus_index, trip_id, arrivals);
+
+  // only the next few arrivals of each bus are kept, within the window; 
+  // the phone removes a bus' old arrivals before adding new ones, so the
+  // list doesn't grow past what was reserved
+  if(arrival_delta < ARRIVAL_WINDOW_BEFORE || 
+     arrival_delta > ARRIVAL_WINDOW_AFTER) {
     return;
   }
+  uint16_t bus_arrivals = 0;
+  int16_t bus_last = -1;
+  for(int16_t i = 0; i < MemListCount(arrivals); i++) {
+    Arrival* arrival = (Arrival*)MemListGet(arrivals, i);
+    if(arrival->bus_index == bus_index) {
+      bus_arrivals += 1;
+      bus_last = i;
+    }
+  }
+  if(bus_arrivals >= ARRIVALS_PER_BUS) {
+    Arrival* last = (Arrival*)MemListGet(arrivals, bus_last);
+    if(last->delta <= arrival_delta) {
+      return;
+    }
+    // make room by dropping the bus' furthest out arrival
+    MemListRemove(arrivals, bus_last);
+  }
 
   Arrival temp = ArrivalConstructor(trip_id, 
-                                    scheduled_string, 
-                                    predicted_string, 
-                                    arrival_string, 
+                                    scheduled, 
+                                    predicted, 
                                     arrival_delta, 
-                                    index, 
+                                    bus_index, 
                                     arrival_code);
 
   int16_t pos = -1;
@@ -60,33 +84,23 @@ void AddArrival(const char* stop_id,
   }
 
   APP_LOG(APP_LOG_LEVEL_INFO, 
-          "AddArrival: @%i index:%u delta:%s",
+          "AddArrival: @%i index:%u delta:%i",
           (int)pos, 
-          (uint)index, 
-          arrival_string);
+          (uint)bus_index, 
+          (int)arrival_delta);
 }
 
-Arrival ArrivalConstructor(const char* trip_id, 
-                           const char* scheduled_arrival, 
-                           const char* predicted_arrival, 
-                           const char* delta_string, 
+Arrival ArrivalConstructor(const uint32_t trip_id, 
+                           const int32_t scheduled, 
+                           const int32_t predicted, 
                            const int32_t delta, 
                            const uint8_t bus_index,
                            const char arrival_code) {
                               
   Arrival arrival;
-  int l = strlen(trip_id);
-  arrival.trip_id = (char *)malloc(sizeof(char)*(l+1));
-  StringCopy(arrival.trip_id, trip_id, l+1);
-  l = strlen(scheduled_arrival);
-  arrival.scheduled_arrival = (char *)malloc(sizeof(char)*(l+1));
-  StringCopy(arrival.scheduled_arrival, scheduled_arrival, l+1);
-  l = strlen(predicted_arrival);
-  arrival.predicted_arrival = (char *)malloc(sizeof(char)*(l+1));
-  StringCopy(arrival.predicted_arrival, predicted_arrival, l+1);
-  l = strlen(delta_string);
-  arrival.delta_string = (char *)malloc(sizeof(char)*(l+1));
-  StringCopy(arrival.delta_string, delta_string, l+1);
+  arrival.trip_id = trip_id;
+  arrival.scheduled = scheduled;
+  arrival.predicted = predicted;
   arrival.delta = delta;
   arrival.bus_index = bus_index;
   arrival.arrival_code = arrival_code;
@@ -94,31 +108,18 @@ Arrival ArrivalConstructor(const char* trip_id,
 }
 
 Arrival ArrivalCopy(const Arrival* arrival) {
-  return ArrivalConstructor(arrival->trip_id, 
-                            arrival->scheduled_arrival, 
-                            arrival->predicted_arrival, 
-                            arrival->delta_string, 
-                            arrival->delta, 
-                            arrival->bus_index, 
-                            arrival->arrival_code);
+  return *arrival;
 }
 
 void ArrivalDestructor(Arrival* arrival) {
+  arrival->trip_id = 0;
+  arrival->scheduled = arrival->predicted = 0;
   arrival->delta = arrival->bus_index = 0;
-  arrival->arrival_code = 'x';
-  FreeAndClearPointer((void**)&arrival->trip_id);
-  FreeAndClearPointer((void**)&arrival->scheduled_arrival);
-  FreeAndClearPointer((void**)&arrival->predicted_arrival);
-  FreeAndClearPointer((void**)&arrival->delta_string);
+  arrival->arrival_code = ARRIVAL_CODE_REMOVED;
 }
 
 Arrivals* ArrivalsCopy(const Arrivals* arrivals) {
-  Arrivals* arrivals_copy = MemListCopy(arrivals);
-  for(uint16_t i = 0; i < MemListCount(arrivals); i++) {
-    Arrival* dest = MemListGet(arrivals_copy, i);
-    *dest = ArrivalCopy((Arrival*)MemListGet(arrivals, i));
-  }
-  return arrivals_copy;
+  return MemListCopy(arrivals);
 }
 
 void ArrivalsConstructor(Arrivals** arrivals) {
@@ -126,10 +127,93 @@ void ArrivalsConstructor(Arrivals** arrivals) {
 }
 
 void ArrivalsDestructor(Arrivals* arrivals) {
+  MemListClear(arrivals);
+}
+
+// Move the arrivals forward by 'seconds', dropping any that departed too 
+// long ago to be of interest
+void ArrivalsAge(Arrivals* arrivals, const int32_t seconds) {
+  uint16_t i = 0;
+  while(i < MemListCount(arrivals)) {
+    Arrival* arrival = (Arrival*)MemListGet(arrivals, i);
+    arrival->delta -= seconds;
+    if(arrival->delta < ARRIVAL_DEPARTED_LIMIT) {
+      MemListRemove(arrivals, i);
+    }
+    else {
+      i++;
+    }
+  }
+}
+
+void RemoveArrival(const uint32_t bus_index, 
+                   const uint32_t trip_id, 
+                   Arrivals* arrivals) {
   for(uint16_t i = 0; i < MemListCount(arrivals); i++) {
-    ArrivalDestructor((Arrival*)MemListGet(arrivals, i));
+    Arrival* arrival = (Arrival*)MemListGet(arrivals, i);
+    if(arrival->trip_id == trip_id && arrival->bus_index == bus_index) {
+      MemListRemove(arrivals, i);
+      return;
+    }
   }
-  MemListClear(arrivals);
+}
+
+// Replace the contents of 'dest' with a copy of 'src'
+bool ArrivalsAssign(Arrivals* dest, const Arrivals* src) {
+  MemListClear(dest);
+  if(!MemListReserve(dest, MemListCount(src))) {
+    return false;
+  }
+  for(uint16_t i = 0; i < MemListCount(src); i++) {
+    MemListAppend(dest, MemListGet(src, i));
+  }
+  return true;
+}
+
+// Make room for the most arrivals 'bus_count' buses can have, so that 
+// adding them doesn't allocate
+bool ArrivalsReserve(Arrivals* arrivals, const uint16_t bus_count) {
+  return MemListReserve(arrivals, bus_count * ARRIVALS_PER_BUS);
+}
+
+// Recompute the time until each arrival from its arrival time; the order
+// of the list doesn't change. Returns true if the whole minutes shown for
+// any arrival changed.
+bool ArrivalsUpdateDeltas(Arrivals* arrivals, const time_t now) {
+  bool changed = false;
+  for(uint16_t i = 0; i < MemListCount(arrivals); i++) {
+    Arrival* arrival = (Arrival*)MemListGet(arrivals, i);
+    int32_t delta = ArrivalTime(arrival) - now;
+    if((delta / SECONDS_PER_MINUTE != arrival->delta / SECONDS_PER_MINUTE) ||
+       ((delta < 0) != (arrival->delta < 0))) {
+      changed = true;
+    }
+    arrival->delta = delta;
+  }
+  return changed;
+}
+
+// Seconds from 'now' until the whole minutes shown for any arrival next
+// change, by the same count as ArrivalsUpdateDeltas(); 0 if there are no
+// arrivals
+uint32_t ArrivalsNextChange(const Arrivals* arrivals, const time_t now) {
+  uint32_t next = 0;
+  for(uint16_t i = 0; i < MemListCount(arrivals); i++) {
+    int32_t delta = ArrivalTime((Arrival*)MemListGet(arrivals, i)) - now;
+    // minutes are truncated toward zero, and the sign changes after 0
+    uint32_t change = (delta >= 0) ? 
+        (delta % SECONDS_PER_MINUTE) + 1 : 
+        SECONDS_PER_MINUTE - ((-delta) % SECONDS_PER_MINUTE);
+    if((next == 0) || (change < next)) {
+      next = change;
+    }
+  }
+  return next;
+}
+
+// Epoch seconds the bus arrives, predicted if there is a prediction
+int32_t ArrivalTime(const Arrival* arrival) {
+  return (arrival->predicted != 0) ? arrival->predicted : arrival->scheduled;
 }
 
 ArrivalColors ArrivalColor(const Arrival arrival) {
@@ -164,6 +248,15 @@ ArrivalColors ArrivalColor(const Arrival arrival) {
   return retval;
 }
 
+// Colors for arrivals shown from a snapshot, before live data is in
+ArrivalColors ArrivalStaleColor() {
+  ArrivalColors retval;
+  retval.foreground = PBL_IF_COLOR_ELSE(GColorDarkGray, GColorBlack);
+  retval.background = PBL_IF_COLOR_ELSE(GColorLightGray, GColorWhite);
+  retval.boarder = PBL_IF_COLOR_ELSE(GColorDarkGray, GColorBlack);
+  return retval;
+}
+
 const char* ArrivalText(const Arrival a) {
   switch(a.arrival_code) {
     case 'e':
@@ -190,22 +283,51 @@ const char* ArrivalDepartedText(const Arrival arrival) {
   }
 }
 
-const char* ArrivalPredicted(const Arrival arrival) {
-  int i = strlen(arrival.predicted_arrival);
-  if(i > 0) {
-    return arrival.predicted_arrival;
+// Format an epoch time as e.g. "5:32PM"
+static void ArrivalTimeString(const int32_t epoch, char* buffer, size_t size) {
+  time_t t = epoch;
+  struct tm* local = localtime(&t);
+  int hour = local->tm_hour % 12;
+  snprintf(buffer, 
+           size, 
+           "%i:%02i%s",
+           hour == 0 ? 12 : hour,
+           local->tm_min,
+           local->tm_hour < 12 ? "AM" : "PM");
+}
+
+// Format the time until arrival as e.g. "12:05" or "-1:30", substituting
+// "Now" for times below |1 min|
+void ArrivalDeltaString(const Arrival arrival, char* buffer, size_t size) {
+  int32_t seconds = arrival.delta < 0 ? -arrival.delta : arrival.delta;
+  int32_t minutes = seconds / 60;
+  if(minutes > 0) {
+    snprintf(buffer, 
+             size, 
+             "%s%i:%02i",
+             arrival.delta < 0 ? "-" : "",
+             (int)minutes,
+             (int)(seconds % 60));
   }
   else {
-    return "n/a";
+    snprintf(buffer, size, "Now");
   }
 }
 
-const char* ArrivalScheduled(const Arrival arrival) {
-  int i = strlen(arrival.scheduled_arrival);
-  if(i > 0) {
-    return arrival.scheduled_arrival;
+void ArrivalPredicted(const Arrival arrival, char* buffer, size_t size) {
+  if(arrival.predicted != 0) {
+    ArrivalTimeString(arrival.predicted, buffer, size);
   }
   else {
-    return "n/a";
+    snprintf(buffer, size, "n/a");
   }
- }
+}
+
+void ArrivalScheduled(const Arrival arrival, char* buffer, size_t size) {
+  if(arrival.scheduled != 0) {
+    ArrivalTimeString(arrival.scheduled, buffer, size);
+  }
+  else {
+    snprintf(buffer, size, "n/a");
+  }
+}
@@ -11,38 +11,50 @@ typedef struct ArrivalsColor {
   GColor boarder;
 } ArrivalColors;
 
+// Fixed size arrival record; holds no pointers so a list of arrivals can be
+// copied with a single memcpy. Display strings are formatted on demand.
 typedef struct Arrival {
-  char* trip_id;
-  char* delta_string;
-  char* predicted_arrival;
-  char* scheduled_arrival;
-  int32_t delta;
+  uint32_t trip_id;   // StringHash() of the OBA trip id
+  int32_t scheduled;  // epoch seconds
+  int32_t predicted;  // epoch seconds, 0 if no prediction is available
+  int32_t delta;      // seconds until arrival, negative once departed
   uint8_t bus_index;
   char arrival_code;
 } __attribute__((__packed__)) Arrival;
 
 typedef MemList Arrivals;
 
-// typedef struct Arrivals {
-//   uint32_t count;
-//   Arrival* data;
-// } __attribute__((__packed__)) Arrivals;
+// buffer sizes for the Arrival*String() formatters
+#define ARRIVAL_TIME_STRING_SIZE 10
+#define ARRIVAL_DELTA_STRING_SIZE 12
+
+// arrival code of a record that removes the arrival from the list
+#define ARRIVAL_CODE_REMOVED 'x'
+
+// arrivals that departed longer ago than this are dropped when aged
+#define ARRIVAL_DEPARTED_LIMIT (-5*SECONDS_PER_MINUTE)
+
+// only the next ARRIVALS_PER_BUS arrivals of each bus between 
+// ARRIVAL_WINDOW_BEFORE and ARRIVAL_WINDOW_AFTER seconds from now are kept;
+// the phone applies the same limits, see addArrivalsForBus() in app.js
+#ifndef ARRIVALS_PER_BUS
+#define ARRIVALS_PER_BUS 3
+#endif
+#define ARRIVAL_WINDOW_BEFORE (-2*SECONDS_PER_MINUTE)
+#define ARRIVAL_WINDOW_AFTER (35*SECONDS_PER_MINUTE)
 
 void ListArrivals(const Arrivals* arrivals);
-void AddArrival(const char* stop_id, 
-                const char* route_id,
-                const char* trip_id, 
-                const char* scheduled_string,
-                const char* predicted_string, 
-                const char* arrival_string,
+void AddArrival(const uint32_t bus_index,
+                const uint32_t trip_id, 
+                const int32_t scheduled,
+                const int32_t predicted,
                 const int32_t arrival_delta, 
                 const char arrival_code, 
                 const Buses* buses,
                 Arrivals* arrival);
-Arrival ArrivalConstructor(const char* trip_id, 
-                           const char* scheduled_arrival, 
-                           const char* predicted_arrival, 
-                           const char* delta_string, 
+Arrival ArrivalConstructor(const uint32_t trip_id, 
+                           const int32_t scheduled, 
+                           const int32_t predicted, 
                            const int32_t delta, 
                            const uint8_t bus_index, 
                            const char arrival_code);
@@ -51,10 +63,21 @@ void ArrivalDestructor(Arrival*);
 Arrivals* ArrivalsCopy(const Arrivals*);
 void ArrivalsConstructor(Arrivals**);
 void ArrivalsDestructor(Arrivals*);
+void ArrivalsAge(Arrivals*, const int32_t seconds);
+bool ArrivalsAssign(Arrivals* dest, const Arrivals* src);
+bool ArrivalsReserve(Arrivals*, const uint16_t bus_count);
+bool ArrivalsUpdateDeltas(Arrivals*, const time_t now);
+uint32_t ArrivalsNextChange(const Arrivals*, const time_t now);
+int32_t ArrivalTime(const Arrival*);
+void RemoveArrival(const uint32_t bus_index, 
+                   const uint32_t trip_id, 
+                   Arrivals* arrivals);
+ArrivalColors ArrivalStaleColor();
 ArrivalColors ArrivalColor(const Arrival);
 const char* ArrivalText(const Arrival);
 const char* ArrivalDepartedText(const Arrival);
-const char* ArrivalPredicted(const Arrival);
-const char* ArrivalScheduled(const Arrival);
+void ArrivalDeltaString(const Arrival, char* buffer, size_t size);
+void ArrivalPredicted(const Arrival, char* buffer, size_t size);
+void ArrivalScheduled(const Arrival, char* buffer, size_t size);
 
 #endif // ARRIVALS_H
@@ -11,6 +11,13 @@
 typedef struct {
   Bus bus;
   Arrival arrival;
+  // text layers keep a pointer to their text, so the formatted arrival
+  // strings live here rather than on the stack
+  struct {
+    char delta[ARRIVAL_DELTA_STRING_SIZE];
+    char predicted[ARRIVAL_TIME_STRING_SIZE];
+    char scheduled[ARRIVAL_TIME_STRING_SIZE];
+  } strings;
   struct {
     TextLayer *header;
     Layer *status_box;
@@ -284,6 +291,16 @@ static void InitTextLayers() {
 }
 
 static void SetTextStrings() {
+  ArrivalDeltaString(s_content.arrival, 
+                     s_content.strings.delta, 
+                     sizeof(s_content.strings.delta));
+  ArrivalPredicted(s_content.arrival, 
+                   s_content.strings.predicted, 
+                   sizeof(s_content.strings.predicted));
+  ArrivalScheduled(s_content.arrival, 
+                   s_content.strings.scheduled, 
+                   sizeof(s_content.strings.scheduled));
+
   const char* header_text = s_content.bus.route_name;
   text_layer_set_text(s_content.card_one.header, header_text);
   text_layer_set_text(s_content.card_one.stop_details, 
@@ -293,13 +310,13 @@ static void SetTextStrings() {
   text_layer_set_text(s_content.card_one.arrival_label, 
                       ArrivalDepartedText(s_content.arrival));
   text_layer_set_text(s_content.card_one.arrival, 
-                      s_content.arrival.delta_string);
+                      s_content.strings.delta);
   text_layer_set_text(s_content.card_one.predicted_label, "Predicted:");
   text_layer_set_text(s_content.card_one.predicted, 
-                      ArrivalPredicted(s_content.arrival));
+                      s_content.strings.predicted);
   text_layer_set_text(s_content.card_two.scheduled_label, "Scheduled:");
   text_layer_set_text(s_content.card_two.scheduled, 
-                      ArrivalScheduled(s_content.arrival));
+                      s_content.strings.scheduled);
   text_layer_set_text(s_content.card_two.direction_label, "Direction:");
   text_layer_set_text(s_content.card_two.direction, s_content.bus.direction);
   text_layer_set_text(s_content.card_two.bus_details_label, "Description:");
@@ -468,9 +485,13 @@ static void WindowLoad(Window *window) {
   s_menu_circle_layer = layer_create(bounds);
   layer_set_update_proc(s_menu_circle_layer, MenuCircleUpdateProc);
   layer_add_child(window_layer, s_menu_circle_layer);
+
+  // the first card counts the arrival down in seconds
+  MainWindowCountdownSeconds(true);
 }
 
 static void WindowUnload(Window *window) {
+  MainWindowCountdownSeconds(false);
   ArrivalDestructor(&s_content.arrival);
 //   FreeAndClearPointer((void**)&s_content.arrival);
   
@@ -506,6 +527,7 @@ static void SwitchLayer(const int current, const int next) {
   layer_set_hidden(s_layers[current], true);
   layer_set_hidden(s_layers[next], false);
   s_layer_index = next;
+  MainWindowCountdownSeconds(next == 0);
 }
 
 static void SetLayerFromDelta(const int delta) {
@@ -557,19 +579,19 @@ void BusDetailsWindowPush(
   window_stack_push(s_window, true);
 }
 
-static const char* BusDetailsWindowGetTripId() {
+static uint32_t BusDetailsWindowGetTripId() {
   if(s_window) {
     return s_content.arrival.trip_id;
   }
   else {
-    return NULL;
+    return 0;
   }
 }
 
 static void BusDetailsWindowUpdateContent(const Bus bus,
                                           const Arrival* arrival) {
-  if(s_window && (s_content.arrival.trip_id != NULL) && 
-     (strcmp(s_content.arrival.trip_id, arrival->trip_id) == 0)) {
+  if(s_window && (s_content.arrival.trip_id != 0) && 
+     (s_content.arrival.trip_id == arrival->trip_id)) {
     s_content.bus = bus;
     ArrivalDestructor(&s_content.arrival);
     // FreeAndClearPointer((void**)&s_content.arrival);
@@ -584,12 +606,12 @@ static void BusDetailsWindowUpdateContent(const Bus bus,
 }
 
 void BusDetailsWindowUpdate(AppData* appdata) {
-  const char* trip_id = BusDetailsWindowGetTripId();
+  uint32_t trip_id = BusDetailsWindowGetTripId();
   
-  if(trip_id != NULL) {
+  if(trip_id != 0) {
     for(uint i = 0; i < appdata->arrivals->count; i++) {
       Arrival* arrival = (Arrival*)MemListGet(appdata->arrivals, i);
-      if(strcmp(arrival->trip_id, trip_id) == 0) {
+      if(arrival->trip_id == trip_id) {
         uint32_t bus_index = arrival->bus_index;
         BusDetailsWindowUpdateContent(appdata->buses.data[bus_index], 
                                       arrival);
@@ -599,6 +621,24 @@ void BusDetailsWindowUpdate(AppData* appdata) {
   }
 }
 
+// Count the shown arrival down between refreshes
+void BusDetailsWindowTick(const time_t now) {
+  if(!s_window || (s_content.arrival.trip_id == 0)) {
+    return;
+  }
+
+  s_content.arrival.delta = ArrivalTime(&s_content.arrival) - now;
+
+  char delta[ARRIVAL_DELTA_STRING_SIZE];
+  ArrivalDeltaString(s_content.arrival, delta, sizeof(delta));
+  if(strcmp(delta, s_content.strings.delta) != 0) {
+    strncpy(s_content.strings.delta, delta, sizeof(s_content.strings.delta));
+    layer_mark_dirty(text_layer_get_layer(s_content.card_one.arrival));
+    text_layer_set_text(s_content.card_one.arrival_label, 
+                        ArrivalDepartedText(s_content.arrival));
+  }
+}
+
 void BusDetailsWindowRemove(void) {
   if(s_window) {
     window_stack_remove(s_window, true);
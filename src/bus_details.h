@@ -13,6 +13,7 @@ typedef enum {
 } ScrollDirection;
 
 void BusDetailsWindowUpdate(AppData* appdata);
+void BusDetailsWindowTick(const time_t now);
 void BusDetailsWindowPush(const Bus, const Arrival*, AppData* appdata);
 void BusDetailsWindowRemove();
 
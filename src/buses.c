@@ -100,39 +100,200 @@ void CreateRoutesFromBuses(const Buses* buses, const Stop* stop, Routes* routes)
   }
 }
 
-void FilterBusesByLocation(const sll lat, const sll lon, Buses* buses) {
+#define FILTER_WORD_BITS 32
+#define FILTER_WORDS(count) (((count) + FILTER_WORD_BITS - 1) / FILTER_WORD_BITS)
+
+static void FilterSet(Buses* buses, uint32_t index, bool nearby) {
+  uint32_t mask = (uint32_t)1 << (index % FILTER_WORD_BITS);
+  if(nearby) {
+    buses->filter_bits[index / FILTER_WORD_BITS] |= mask;
+  }
+  else {
+    buses->filter_bits[index / FILTER_WORD_BITS] &= ~mask;
+  }
+}
+
+// Make sure the filter bitset has a bit for every bus, keeping the current
+// bits. Only allocates when the number of buses outgrows the bitset.
+static bool FilterReserve(Buses* buses) {
+  uint16_t words = FILTER_WORDS(buses->count);
+  if(words <= buses->filter_words) {
+    return true;
+  }
+
+  uint32_t* temp = (uint32_t*)realloc(buses->filter_bits, 
+                                      sizeof(uint32_t)*words);
+  if(temp == NULL) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "NULL FILTER POINTER");
+    ErrorWindowPush(
+        "Critical error\n\nOut of memory\n\n0x100022", 
+        true);
+    buses->filter_valid = false;
+    return false;
+  }
+  memset(&temp[buses->filter_words], 
+         0, 
+         sizeof(uint32_t)*(words - buses->filter_words));
+  buses->filter_bits = temp;
+  buses->filter_words = words;
+  return true;
+}
+
+// Returns true if the set of nearby buses changed
+static bool FilterBuses(const sll lat, 
+                        const sll lon, 
+                        const uint32_t radius, 
+                        Buses* buses) {
   APP_LOG(APP_LOG_LEVEL_INFO, "Filtering buses by location:");
+  bool changed = !buses->filter_valid;
   buses->filter_count = 0;
-  FreeAndClearPointer((void**)&buses->filter_index);
-  for(uint32_t i = 0; i < buses->count; i++)  {
-    Bus b = buses->data[i];
-    // distance in KM
-    sll d = DistanceBetweenSLL(b.lat, b.lon, lat, lon);
-
-    //TODO / IDEA: make this return at least one stop,
-    //  or search outward from the radius to find some...
-    uint32_t radius = PersistReadArrivalRadius();
-    sll sll_radius = slldiv(int2sll(radius), int2sll(1000));
-    if(d <= sll_radius) {
-      uint32_t* temp = (uint32_t*)malloc(sizeof(uint32_t) *
-                                         (buses->filter_count+1));
-      if(temp == NULL) {
-        APP_LOG(APP_LOG_LEVEL_ERROR, "NULL FILTER POINTER");
-        ErrorWindowPush(
-            "Critical error\n\nOut of memory\n\n0x100022", 
-            true);
-      }
-      if(buses->filter_index != NULL) {
-        memcpy(temp, buses->filter_index, sizeof(uint32_t)*buses->filter_count);
-        free(buses->filter_index);
+  buses->filter_valid = false;
+  if(!FilterReserve(buses)) {
+    return true;
+  }
+
+  //TODO / IDEA: make this return at least one stop,
+  //  or search outward from the radius to find some...
+  DistanceQueryInit(&buses->filter_query, lat, lon, radius);
+  DistanceQueryInit(&buses->filter_moved_query, 
+                    lat, 
+                    lon, 
+                    radius / FILTER_MOVE_FRACTION);
+  buses->filter_radius = radius;
+  buses->filter_valid = true;
+
+  // build each word of the bitset, comparing it against the old one
+  for(uint16_t w = 0; w < buses->filter_words; w++) {
+    uint32_t bits = 0;
+    uint32_t first = (uint32_t)w * FILTER_WORD_BITS;
+    for(uint32_t i = first; 
+        (i < buses->count) && (i < first + FILTER_WORD_BITS); 
+        i++) {
+      if(DistanceQueryContains(&buses->filter_query, 
+                               buses->data[i].lat, 
+                               buses->data[i].lon)) {
+        bits |= (uint32_t)1 << (i - first);
+        buses->filter_count += 1;
       }
-      buses->filter_index = temp;
-      buses->filter_index[buses->filter_count] = i;
+    }
+    changed = changed || (bits != buses->filter_bits[w]);
+    buses->filter_bits[w] = bits;
+  }
+  return changed;
+}
+
+void FilterBusesByLocation(const sll lat, const sll lon, Buses* buses) {
+  FilterBuses(lat, lon, PersistReadArrivalRadius(), buses);
+}
+
+// Take the filter from a little endian bitmap of nearby buses, as filtered
+// by the phone. The filter is left invalid, so that it's redone on the 
+// watch if the watch filters by location later on.
+void BusesSetFilterBitmap(const uint8_t* bitmap, uint16_t size, Buses* buses) {
+  buses->filter_count = 0;
+  buses->filter_valid = false;
+  if(!FilterReserve(buses)) {
+    return;
+  }
+  if(buses->filter_bits != NULL) {
+    memset(buses->filter_bits, 0, sizeof(uint32_t)*buses->filter_words);
+  }
+
+  for(uint32_t i = 0; (i < buses->count) && (i / 8 < size); i++) {
+    if(bitmap[i / 8] & (1 << (i % 8))) {
+      FilterSet(buses, i, true);
       buses->filter_count += 1;
     }
   }
 }
 
+// Only filters the buses again if the user has moved far enough, or the
+// radius has changed, since the last filter. Favorites that were added or
+// removed in the meantime are already accounted for. Returns true if the
+// set of nearby buses changed.
+bool RefilterBusesByLocation(const sll lat, const sll lon, Buses* buses) {
+  uint32_t radius = PersistReadArrivalRadius();
+  if(buses->filter_valid && 
+     (buses->filter_radius == radius) &&
+     DistanceQueryContains(&buses->filter_moved_query, lat, lon)) {
+    return false;
+  }
+  return FilterBuses(lat, lon, radius, buses);
+}
+
+// Filter a newly added bus against the last filter
+static void FilterAdd(Buses* buses, uint32_t index) {
+  if(!buses->filter_valid || !FilterReserve(buses)) {
+    return;
+  }
+  bool nearby = DistanceQueryContains(&buses->filter_query, 
+                                      buses->data[index].lat, 
+                                      buses->data[index].lon);
+  FilterSet(buses, index, nearby);
+  if(nearby) {
+    buses->filter_count += 1;
+  }
+}
+
+// Drop a bus from the filter, shifting down the bits of the buses after it;
+// call before the bus is removed from buses
+static void FilterRemove(Buses* buses, uint32_t index) {
+  if(!buses->filter_valid || (buses->filter_bits == NULL)) {
+    return;
+  }
+  if(BusesIsFiltered(buses, index)) {
+    buses->filter_count -= 1;
+  }
+  for(uint32_t i = index; i + 1 < buses->count; i++) {
+    FilterSet(buses, i, BusesIsFiltered(buses, i + 1));
+  }
+  FilterSet(buses, buses->count - 1, false);
+}
+
+bool BusesIsFiltered(const Buses* buses, uint32_t index) {
+  if((index >= buses->count) || 
+     (index / FILTER_WORD_BITS >= buses->filter_words)) {
+    return false;
+  }
+  return (buses->filter_bits[index / FILTER_WORD_BITS] >> 
+          (index % FILTER_WORD_BITS)) & 1;
+}
+
+// Returns the index of the next nearby bus after 'index', or buses->count
+// if there are no more
+uint32_t BusesFilterNext(const Buses* buses, uint32_t index) {
+  uint32_t i = index + 1;
+  uint32_t limit = MIN(buses->count, 
+                       (uint32_t)buses->filter_words*FILTER_WORD_BITS);
+  while(i < limit) {
+    // skip straight over the clear bits of this word
+    uint32_t word = buses->filter_bits[i / FILTER_WORD_BITS] >> 
+        (i % FILTER_WORD_BITS);
+    if(word != 0) {
+      i += __builtin_ctz(word);
+      return (i < buses->count) ? i : buses->count;
+    }
+    i = (i / FILTER_WORD_BITS + 1) * FILTER_WORD_BITS;
+  }
+  return buses->count;
+}
+
+// Returns the index of the first nearby bus, or buses->count if none
+uint32_t BusesFilterFirst(const Buses* buses) {
+  return BusesIsFiltered(buses, 0) ? 0 : BusesFilterNext(buses, 0);
+}
+
+// The filter as a little endian bitmap of 'size' bytes, bit i set if bus i
+// is nearby; NULL if there is no filter
+const uint8_t* BusesFilterBitmap(const Buses* buses, uint16_t* size) {
+  if(!buses->filter_valid || buses->filter_bits == NULL) {
+    *size = 0;
+    return NULL;
+  }
+  *size = (buses->count + 7) / 8;
+  return (const uint8_t*)buses->filter_bits;
+}
+
 void BusDestructor(Bus* bus) {
   FreeAndClearPointer((void**)&bus->route_id);
   FreeAndClearPointer((void**)&bus->stop_id);
@@ -147,7 +308,64 @@ void BusesDestructor(Buses* buses) {
     BusDestructor(&buses->data[i]);
   }
   FreeAndClearPointer((void**)&buses->data);
-  FreeAndClearPointer((void**)&buses->filter_index);
+  FreeAndClearPointer((void**)&buses->filter_bits);
+  buses->filter_words = 0;
+  buses->filter_valid = false;
+  FreeAndClearPointer((void**)&buses->hash_index);
+  buses->hash_size = 0;
+}
+
+static uint32_t BusHash(const char* stop_id, const char* route_id) {
+  return (StringHash(stop_id) * 31) ^ StringHash(route_id);
+}
+
+// Recompute the version hash after the list of buses has changed
+void BusesUpdateVersion(Buses* buses) {
+  uint32_t version = 2166136261u ^ buses->count;
+  for(uint32_t i = 0; i < buses->count; i++) {
+    version ^= BusHash(buses->data[i].stop_id, buses->data[i].route_id);
+    version *= 16777619u;
+  }
+  buses->version = version;
+}
+
+// Place bus 'index' in the hash index; assumes a free slot exists
+static void BusesIndexInsert(Buses* buses, uint32_t index) {
+  uint16_t mask = buses->hash_size - 1;
+  uint16_t slot = BusHash(buses->data[index].stop_id,
+                          buses->data[index].route_id) & mask;
+  while(buses->hash_index[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  buses->hash_index[slot] = index + 1;
+}
+
+// (Re)build the hash index from scratch, keeping the table at most half full
+void BusesBuildIndex(Buses* buses) {
+  FreeAndClearPointer((void**)&buses->hash_index);
+  buses->hash_size = 0;
+
+  if(buses->count == 0) {
+    return;
+  }
+
+  uint16_t size = BUSES_HASH_MIN_SIZE;
+  while(size < buses->count*2) {
+    size <<= 1;
+  }
+
+  buses->hash_index = (uint16_t*)malloc(sizeof(uint16_t)*size);
+  if(buses->hash_index == NULL) {
+    // GetBusIndex falls back to a linear scan
+    APP_LOG(APP_LOG_LEVEL_ERROR, "NULL HASH INDEX POINTER");
+    return;
+  }
+  memset(buses->hash_index, 0, sizeof(uint16_t)*size);
+  buses->hash_size = size;
+
+  for(uint32_t i = 0; i < buses->count; i++) {
+    BusesIndexInsert(buses, i);
+  }
 }
 
 static bool CreateBus(const char* route_id,
@@ -195,6 +413,17 @@ static bool CreateBus(const char* route_id,
     buses->data = temp_buses;
     buses->data[buses->count] = temp_bus;
     buses->count+=1;
+
+    FilterAdd(buses, buses->count-1);
+
+    if((buses->hash_index != NULL) && (buses->count*2 <= buses->hash_size)) {
+      BusesIndexInsert(buses, buses->count-1);
+    }
+    else {
+      BusesBuildIndex(buses);
+    }
+    BusesUpdateVersion(buses);
+
     success = SaveBusCountToPersistence(buses->count);
   }
   else {
@@ -233,12 +462,27 @@ int32_t GetBusIndex(
     const char* route_id,
     const Buses* buses) {
 
-  for(uint32_t i  = 0; i < buses->count; i++) {
+  if(buses->hash_index == NULL) {
+    for(uint32_t i  = 0; i < buses->count; i++) {
+      Bus bus = buses->data[i];
+      if((strcmp(bus.stop_id, stop_id) == 0) &&
+          (strcmp(bus.route_id, route_id) == 0)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  uint16_t mask = buses->hash_size - 1;
+  uint16_t slot = BusHash(stop_id, route_id) & mask;
+  while(buses->hash_index[slot] != 0) {
+    uint32_t i = buses->hash_index[slot] - 1;
     Bus bus = buses->data[i];
     if((strcmp(bus.stop_id, stop_id) == 0) &&
         (strcmp(bus.route_id, route_id) == 0)) {
       return i;
     }
+    slot = (slot + 1) & mask;
   }
   return -1;
 }
@@ -253,10 +497,13 @@ void RemoveBus(uint32_t index, Buses *buses) {
 
   // destroy bus
   BusDestructor(&buses->data[index]);
+  FilterRemove(buses, index);
 
   if(buses->count == 1) {
     FreeAndClearPointer((void**)&buses->data);
     buses->count = 0;
+    BusesBuildIndex(buses);
+    BusesUpdateVersion(buses);
     return;
   }
 
@@ -282,6 +529,10 @@ void RemoveBus(uint32_t index, Buses *buses) {
   free(buses->data);
   buses->data = temp_buses;
   buses->count-=1;
+
+  // indices after the removed bus have all shifted down
+  BusesBuildIndex(buses);
+  BusesUpdateVersion(buses);
 }
 
 void AddStop(const uint16_t index,
@@ -320,7 +571,9 @@ void AddStop(const uint16_t index,
                               lon,
                               direction);
   
-  bool success = true;
+  // the buffer holds at most STOPS_BUFFER_SIZE stops plus the one being
+  // inserted before trimming, reserve it once
+  bool success = MemListReserve(stops->memlist, STOPS_BUFFER_SIZE+1);
   
   if(pos == -1) {
     success &= MemListAppend(stops->memlist, &temp);
@@ -330,7 +583,7 @@ void AddStop(const uint16_t index,
   }
   
   uint16_t count = MemListCount(stops->memlist);
-  if(count > 15) {
+  if(count > STOPS_BUFFER_SIZE) {
     if(pos == -1 || pos > 5) {
       // trim the start of the list
       Stop* stop = (Stop*)MemListGet(stops->memlist, 0);
@@ -4,6 +4,17 @@
 #include <pebble.h>
 #include <pebble-math-sll/math-sll.h>
 #include "memlist.h"
+#include "location.h"
+
+// maximum number of nearby stops kept in memory at once
+#define STOPS_BUFFER_SIZE 15
+
+// the nearby favorites are only re-filtered once the user has moved more
+// than 1/FILTER_MOVE_FRACTION of the arrival radius
+#define FILTER_MOVE_FRACTION 4
+
+// smallest number of slots in the buses' hash index (a power of two)
+#define BUSES_HASH_MIN_SIZE 8
 
 // WARNING:
 // CHANGING THIS STRUCT WILL CAUSE A PERSISTENT STORAGE VERSION CHANGE
@@ -28,9 +39,27 @@ typedef struct {
   Bus* data;
   uint32_t count;
 
-  // used to geographically filter nearby buses
-  uint32_t* filter_index;
+  // used to geographically filter nearby buses; one bit per bus, set if
+  // the bus is nearby. Iterate with BusesFilterFirst/BusesFilterNext.
+  uint32_t* filter_bits;
+  uint16_t filter_words;
   uint32_t filter_count;
+
+  // where & how the last filter was done, so favorites can be added or 
+  // removed, and the location refreshed, without filtering everything again
+  DistanceQuery filter_query;
+  DistanceQuery filter_moved_query;
+  uint32_t filter_radius;
+  bool filter_valid;
+
+  // open addressing hash index of (stop_id, route_id) used by GetBusIndex;
+  // each slot holds a bus index + 1, or 0 if the slot is empty
+  uint16_t* hash_index;
+  uint16_t hash_size;
+
+  // hash of the (stop_id, route_id) list, in order; identifies the copy of
+  // the favorites kept on the phone
+  uint32_t version;
 } __attribute__((__packed__)) Buses;
 
 typedef struct {
@@ -66,10 +95,18 @@ void ListStops(const Stops* stops);
 void CreateStopsFromBuses(const Buses* buses, Stops* stops);
 void CreateRoutesFromBuses(const Buses* buses, const Stop* stop, Routes* routes);
 void FilterBusesByLocation(const sll lat, const sll lon, Buses* buses);
+bool RefilterBusesByLocation(const sll lat, const sll lon, Buses* buses);
+void BusesSetFilterBitmap(const uint8_t* bitmap, uint16_t size, Buses* buses);
+bool BusesIsFiltered(const Buses* buses, uint32_t index);
+const uint8_t* BusesFilterBitmap(const Buses* buses, uint16_t* size);
+uint32_t BusesFilterFirst(const Buses* buses);
+uint32_t BusesFilterNext(const Buses* buses, uint32_t index);
 void BusesDestructor(Buses* buses);
 bool AddBus(const Bus* bus, Buses* buses);
 bool AddBusFromStopRoute(const Stop* stop, const Route* route, Buses* buses);
 void RemoveBus(uint32_t index, Buses *buses);
+void BusesBuildIndex(Buses* buses);
+void BusesUpdateVersion(Buses* buses);
 int32_t GetBusIndex(const char* stop_id,
                     const char* route_id,
                     const Buses* buses);
@@ -6,16 +6,44 @@
 #include "utility.h"
 #include "error_window.h"
 #include "persistence.h"
+#include "message.h"
+
+// room for a microdegree coordinate in the bus list
+#define INT_STRING_SIZE 12
+// the arrivals request leaves out the list of buses
+#define NO_BUS_LIST -1
+// ms to wait before retrying a message when the outbox is busy
+#define APP_MESSAGE_RETRY_TIMEOUT 250
 
 static AppTimer *s_timer;
 static Stops *s_nearby_stops;
 static Routes s_nearby_routes;
 static sll s_cached_lat;
 static sll s_cached_lon;
+static time_t s_cached_time;
 static uint32_t s_outstanding_requests;
+static bool s_arrivals_transaction;
+static bool s_location_requested;
+static bool s_location_revalidating;
+static bool s_location_stale;
+static bool s_location_dirty;
+static bool s_phone_filter;
 static uint32_t s_transaction_id;
-static uint32_t s_skipped_arrival_updates;
-static uint32_t s_last_outstanding_request_at_skipped;
+static uint32_t s_inbox_size;
+static uint32_t s_request_transaction_id;
+static int32_t s_request_bus_list_index;
+static uint32_t s_live_transaction_id;
+static bool s_next_arrivals_seeded;
+static time_t s_transaction_deadline;
+static bool s_transaction_resent;
+static uint32_t s_next_sequence;
+static bool s_resend_requested;
+static AppTimer* s_resend_timer;
+static bool s_predictions_volatile;
+static AppData* s_appdata;
+static bool s_app_focused;
+static bool s_refresh_suspended;
+static bool s_battery_low;
 
 #ifdef LOGGING_ENABLED
 // AppMessage error translators
@@ -59,50 +87,236 @@ const char *TranslateError(const AppMessageResult result) {
 
 static void CancelOutstandingRequests() {
   s_outstanding_requests = 0;
-  s_skipped_arrival_updates = 0;
-  s_last_outstanding_request_at_skipped = 0;
+  s_arrivals_transaction = false;
+  s_next_sequence = 0;
+  s_resend_requested = false;
+  if(s_resend_timer) {
+    app_timer_cancel(s_resend_timer);
+    s_resend_timer = NULL;
+  }
   s_transaction_id += 1;
 }
 
-static void NextTimer(AppData* appdata);
+// The arrivals transaction made progress; it has a while longer before it's
+// considered stalled
+static void ExtendTransactionDeadline() {
+  s_transaction_deadline = time(NULL) + ARRIVALS_TRANSACTION_TIMEOUT;
+  s_transaction_resent = false;
+}
 
-static void UpdateArrivalsCallback(void *context) {
-  // only start the next arrivals transaction if the previous one has finished
-  if(s_outstanding_requests == 0) {
-    s_skipped_arrival_updates = 0;
-    s_last_outstanding_request_at_skipped = 0;
-    UpdateArrivals((AppData*)context);
+static void SendAppMessageArrivalsResendCallback(void* context);
+
+// Ask the phone to send the arrivals batches again, starting at the next 
+// one expected; each batch is only asked for once, and only while an 
+// arrivals transaction is outstanding
+static void SendAppMessageArrivalsResend() {
+  if(s_resend_requested || 
+     (s_resend_timer != NULL) || 
+     !s_arrivals_transaction ||
+     (s_outstanding_requests == 0)) {
+    return;
   }
-  else {
-    if(s_outstanding_requests == s_last_outstanding_request_at_skipped) {
-      // only increment if progress is stalled
-      s_skipped_arrival_updates += 1;
+
+  DictionaryIterator *iterator;
+  if(app_message_outbox_begin(&iterator) != APP_MSG_OK) {
+    // the outbox is busy; try again shortly
+    s_resend_timer = app_timer_register(APP_MESSAGE_RETRY_TIMEOUT, 
+                                        SendAppMessageArrivalsResendCallback, 
+                                        NULL);
+    return;
+  }
+
+  APP_LOG(APP_LOG_LEVEL_INFO, 
+          "SendAppMessageArrivalsResend: from %u", 
+          (uint)s_next_sequence);
+
+  dict_write_uint32(iterator, 
+                    kAppMessageMessageType, 
+                    kAppMessageArrivalsResend);
+  dict_write_uint32(iterator, kAppMessageTransactionId, s_transaction_id);
+  dict_write_uint32(iterator, kAppMessageSequence, s_next_sequence);
+  app_message_outbox_send();
+  s_resend_requested = true;
+}
+
+static void SendAppMessageArrivalsResendCallback(void* context) {
+  s_resend_timer = NULL;
+  SendAppMessageArrivalsResend();
+}
+
+// True if a prediction moved by REFRESH_VOLATILE_PREDICTION or more between
+// the live arrivals and the next ones
+static bool PredictionsVolatile(const Arrivals* arrivals, 
+                                const Arrivals* next_arrivals) {
+  for(uint16_t i = 0; i < MemListCount(next_arrivals); i++) {
+    Arrival* next = (Arrival*)MemListGet(next_arrivals, i);
+    if(next->predicted == 0) {
+      continue;
     }
-    s_last_outstanding_request_at_skipped = s_outstanding_requests;
-    if(s_skipped_arrival_updates > 2) {
-      APP_LOG(APP_LOG_LEVEL_ERROR, 
-              "timer: too many skipped updates, forcing update_arrivals()");
-      
-      // reset 
-      CancelOutstandingRequests();
-      UpdateArrivals((AppData*)context);    
+    for(uint16_t j = 0; j < MemListCount(arrivals); j++) {
+      Arrival* a = (Arrival*)MemListGet(arrivals, j);
+      if((a->trip_id == next->trip_id) && (a->bus_index == next->bus_index)) {
+        int32_t moved = next->predicted - ArrivalTime(a);
+        if(moved >= REFRESH_VOLATILE_PREDICTION || 
+           moved <= -REFRESH_VOLATILE_PREDICTION) {
+          return true;
+        }
+        break;
+      }
     }
   }
-  
-  NextTimer((AppData*)context);
+  return false;
 }
 
+// Pick the time until the next refresh from the arrivals being shown: soon
+// if a bus is close or its prediction is moving around, rarely if nothing
+// but far off or scheduled times are shown
+static uint32_t NextRefreshInterval(const AppData* appdata) {
+  if(s_predictions_volatile) {
+    return REFRESH_INTERVAL_FAST;
+  }
+
+  uint32_t interval = REFRESH_INTERVAL_SLOW;
+  for(uint16_t i = 0; i < MemListCount(appdata->arrivals); i++) {
+    Arrival* a = (Arrival*)MemListGet(appdata->arrivals, i);
+    if(a->delta < 0) {
+      // departed
+      continue;
+    }
+    if(a->delta <= REFRESH_NEAR_ARRIVAL) {
+      return REFRESH_INTERVAL_FAST;
+    }
+    if((a->predicted != 0) && (a->delta <= REFRESH_FAR_ARRIVAL)) {
+      interval = REFRESH_INTERVAL_NORMAL;
+    }
+  }
+  return interval;
+}
+
+static void UpdateArrivalsCallback(void *context);
+
+// While a transaction is outstanding the timer fires at its deadline to 
+// check for a stall; otherwise it fires at the next refresh
 static void NextTimer(AppData* appdata) {
-  s_timer = app_timer_register(30000 /*ms*/, UpdateArrivalsCallback, appdata);
+  uint32_t timeout_ms;
+  if(s_outstanding_requests > 0) {
+    time_t remaining = s_transaction_deadline - time(NULL);
+    timeout_ms = (remaining > 0) ? remaining * 1000 : APP_MESSAGE_RETRY_TIMEOUT;
+  }
+  else {
+    timeout_ms = NextRefreshInterval(appdata);
+    if(s_battery_low) {
+      timeout_ms *= REFRESH_BATTERY_LOW_FACTOR;
+    }
+  }
+  APP_LOG(APP_LOG_LEVEL_INFO, "NextTimer: %u ms", (uint)timeout_ms);
+
+  if((s_timer == NULL) || !app_timer_reschedule(s_timer, timeout_ms)) {
+    s_timer = app_timer_register(timeout_ms, UpdateArrivalsCallback, appdata);
+  }
+}
+
+static void UpdateArrivalsCallback(void *context) {
+  AppData* appdata = context;
+  s_timer = NULL;
+
+  // nobody is looking; wait until the app has focus again
+  if(!s_app_focused) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "timer: unfocused, suspending refreshes");
+    s_refresh_suspended = true;
+    return;
+  }
+
+  // only start the next arrivals transaction if the previous one has 
+  // finished, or has stalled
+  if(s_outstanding_requests == 0) {
+    UpdateArrivals(appdata);
+  }
+  else if((time(NULL) >= s_transaction_deadline) && !s_transaction_resent) {
+    // the last batches may have been lost; ask for them once more
+    APP_LOG(APP_LOG_LEVEL_ERROR, "timer: transaction stalled, resending");
+    s_resend_requested = false;
+    SendAppMessageArrivalsResend();
+    s_transaction_deadline = time(NULL) + ARRIVALS_TRANSACTION_TIMEOUT;
+    s_transaction_resent = true;
+  }
+  else if(time(NULL) >= s_transaction_deadline) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, 
+            "timer: transaction stalled, forcing update_arrivals()");
+    CancelOutstandingRequests();
+    UpdateArrivals(appdata);
+  }
+  
+  NextTimer(appdata);
+}
+
+// Refresh the arrivals now rather than waiting for the timer
+static void RefreshArrivalsNow(AppData* appdata) {
+  if(s_timer) {
+    app_timer_cancel(s_timer);
+    s_timer = NULL;
+  }
+  UpdateArrivalsCallback(appdata);
+}
+
+static void AppFocusCallback(bool in_focus) {
+  s_app_focused = in_focus;
+  if(in_focus && s_refresh_suspended) {
+    // the timer went off while unfocused
+    s_refresh_suspended = false;
+    RefreshArrivalsNow(s_appdata);
+  }
+}
+
+// A flick of the wrist after a while without a refresh asks for one now
+static void AccelTapCallback(AccelAxisType axis, int32_t direction) {
+  if((s_timer != NULL) && 
+     (s_outstanding_requests == 0) &&
+     !s_appdata->arrivals_stale &&
+     (time(NULL) - s_appdata->arrivals_time >= REFRESH_TAP_IDLE)) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "Tap - updating arrivals");
+    RefreshArrivalsNow(s_appdata);
+  }
+}
+
+static void BatteryStateCallback(BatteryChargeState charge) {
+  s_battery_low = !charge.is_plugged && 
+                  (charge.charge_percent <= REFRESH_BATTERY_LOW_PERCENT);
+}
+
+// The arrivals transaction is complete; show the arrivals and schedule the 
+// next refresh based on them
+static void CompleteArrivalsTransaction(AppData* appdata) {
+  APP_LOG(APP_LOG_LEVEL_INFO, 
+          "----Completed transaction id: %u",
+          (uint)s_transaction_id);
+
+  s_predictions_volatile = 
+      PredictionsVolatile(appdata->arrivals, appdata->next_arrivals);
+  appdata->initialized = true;
+  MainWindowUpdateArrivals(appdata);
+
+  if(s_timer != NULL) {
+    NextTimer(appdata);
+  }
 }
 
 void StartArrivalsUpdateTimer(AppData* appdata) {
   if(s_timer == NULL) {
+    // with a last known location the first arrivals needn't wait for the
+    // phone's first fix
+    if(!appdata->initialized && 
+       s_location_stale && 
+       (s_outstanding_requests == 0)) {
+      APP_LOG(APP_LOG_LEVEL_INFO, "Last known location - updating arrivals");
+      UpdateArrivals(appdata);
+    }
     NextTimer(appdata);
   }
 }
 
 void StopArrivalsUpdateTimer() {
+  s_refresh_suspended = false;
   if(s_timer) {
     app_timer_cancel(s_timer);
     s_timer = NULL;
@@ -202,6 +416,8 @@ static void SendAppMessageGetLocation() {
   
   APP_LOG(APP_LOG_LEVEL_INFO, "SendAppMessageGetLocation: Sending...!");
 
+  s_location_requested = true;
+
   // Prepare dictionary
   DictionaryIterator *iterator;
   app_message_outbox_begin(&iterator);
@@ -213,18 +429,179 @@ static void SendAppMessageGetLocation() {
   app_message_outbox_send();
 }
 
+// Ask the phone for a fresh location without cancelling the arrivals
+// transaction that was started from the last known location
+static void SendAppMessageRevalidateLocation() {
+  APP_LOG(APP_LOG_LEVEL_INFO, "SendAppMessageRevalidateLocation: Sending...!");
+
+  DictionaryIterator *iterator;
+  if(app_message_outbox_begin(&iterator) != APP_MSG_OK) {
+    // the outbox is busy; try again once it's clear
+    return;
+  }
+  s_location_stale = false;
+  s_location_revalidating = true;
+
+  dict_write_uint32(iterator, kAppMessageMessageType, kAppMessageLocation);
+  app_message_outbox_send();
+}
+
 static void FilterBusesByCachedLocation(Buses* buses) {
-  // TODO: consider just relying upon the phone to cache the location
-  // (i.e. get rid of this function) or at least allowing the locaiotn
-  // to update periodically (update the location) - all caching here does is
-  // avoid the app message backandforth
+  // the phone pushes a new location whenever it has moved far enough, so
+  // the cached location only needs to be requested once
   if(s_cached_lat == CONST_0 || s_cached_lon == CONST_0) {
     APP_LOG(APP_LOG_LEVEL_INFO, 
             "FilterBusesByCachedLocation: trigger location request");
     SendAppMessageGetLocation();
   }
   else {
-    FilterBusesByLocation(s_cached_lat, s_cached_lon, buses);
+    // cheap unless the user has moved or the radius has changed
+    RefilterBusesByLocation(s_cached_lat, s_cached_lon, buses);
+  }
+}
+
+// Build the "stop,route,lat,lon|..." list of the buses from 'index' on, in
+// index order, for the phone's copy of the buses; lat/lon are in 
+// microdegrees. The list ends before it grows past BUS_LIST_MAX_SIZE, and
+// the phone asks for the rest from where it ends. Returns NULL on failure.
+static char* BuildBusList(const Buses* buses, const uint16_t index) {
+  size_t size = 1;
+  uint32_t end_index = index;
+  while(end_index < buses->count) {
+    size_t bus_size = strlen(buses->data[end_index].stop_id)+
+                      strlen(buses->data[end_index].route_id)+
+                      4+2*INT_STRING_SIZE;
+    // there's always at least one bus
+    if((end_index > index) && (size + bus_size > BUS_LIST_MAX_SIZE)) {
+      break;
+    }
+    size += bus_size;
+    end_index++;
+  }
+
+  char* busList = malloc(size);
+  if(busList == NULL) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "NULL BUS LIST POINTER");
+    return NULL;
+  }
+
+  char* end = busList;
+  *end = '\0';
+  for(uint32_t b = index; b < end_index; b++) {
+    end += snprintf(end, 
+                    size - (end - busList), 
+                    "%s%s,%s,%ld,%ld",
+                    b > index ? "|" : "",
+                    buses->data[b].stop_id,
+                    buses->data[b].route_id,
+                    (long)SllToMicrodegrees(buses->data[b].lat),
+                    (long)SllToMicrodegrees(buses->data[b].lon));
+  }
+  return busList;
+}
+
+// Request arrivals for the nearby buses of the current transaction. The 
+// phone is sent the version of the buses and either a bitmap of the nearby
+// ones, or the radius to filter them by itself. If the phone's copy is out
+// of date, the part of the list of buses starting at 'bus_list_index' is 
+// sent too, or NO_BUS_LIST is given. Returns false if the outbox is busy 
+// and the request should be tried again; if the list of buses can't be 
+// sent, the transaction is abandoned with an error instead, since the phone
+// would only ask for it again.
+static bool SendAppMessageArrivalsRequest(const Buses* buses, 
+                                          const int32_t bus_list_index) {
+  char* busList = NULL;
+  if(bus_list_index != NO_BUS_LIST) {
+    busList = BuildBusList(buses, bus_list_index);
+    if(busList == NULL) {
+      CancelOutstandingRequests();
+      ErrorWindowPush(
+          "Critical error\n\nOut of memory\n\n0x100030", 
+          true);
+      return true;
+    }
+  }
+
+  DictionaryIterator *iterator;
+  if(app_message_outbox_begin(&iterator) != APP_MSG_OK) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "SendAppMessageArrivalsRequest: busy");
+    free(busList);
+    return false;
+  }
+
+  // Write data
+  dict_write_uint32(iterator, kAppMessageMessageType, kAppMessageArrivalTime);
+  dict_write_uint32(iterator, kAppMessageTransactionId, s_transaction_id);
+  dict_write_uint32(iterator, kAppMessageInboxSize, s_inbox_size);
+  dict_write_uint32(iterator, kAppMessageBusesVersion, buses->version);
+  dict_write_uint32(iterator, 
+                    kAppMessageBaseTransactionId, 
+                    s_next_arrivals_seeded ? s_live_transaction_id : 0);
+  if(s_phone_filter) {
+    dict_write_uint32(iterator, kAppMessageRadius, PersistReadArrivalRadius());
+  }
+  else {
+    uint16_t size;
+    const uint8_t* bitmap = BusesFilterBitmap(buses, &size);
+    dict_write_data(iterator, kAppMessageBusFilter, bitmap, size);
+  }
+  if(busList != NULL) {
+    dict_write_uint16(iterator, kAppMessageIndex, bus_list_index);
+    dict_write_uint16(iterator, kAppMessageCount, buses->count);
+    DictionaryResult result = 
+        dict_write_cstring(iterator, kAppMessagebusList, busList);
+    free(busList);
+    if(result != DICT_OK) {
+      // even a single bus doesn't fit in the outbox
+      APP_LOG(APP_LOG_LEVEL_ERROR, "SendAppMessageArrivalsRequest: busList");
+      CancelOutstandingRequests();
+      ErrorWindowPush(
+          "Can't sync favorites\n\nRemove some to continue\n\n0x100031",
+          false);
+      return true;
+    }
+  }
+
+  // Send data
+  app_message_outbox_send();
+  return true;
+}
+
+// Start the next arrivals from the live ones, so the phone only has to send
+// what changed since the transaction that produced them, with room for the
+// arrivals of 'bus_count' buses
+static void SeedNextArrivals(AppData* appdata, const uint16_t bus_count) {
+  s_next_arrivals_seeded = 
+      (s_live_transaction_id != 0) &&
+      ArrivalsAssign(appdata->next_arrivals, appdata->arrivals);
+  if(s_next_arrivals_seeded) {
+    ArrivalsUpdateDeltas(appdata->next_arrivals, time(NULL));
+  }
+  else {
+    ArrivalsDestructor(appdata->next_arrivals);
+  }
+  ArrivalsReserve(appdata->next_arrivals, bus_count);
+}
+
+static void SendArrivalsRequestCallback(void* context);
+
+// Send the arrivals request of the current transaction, trying again 
+// shortly while the outbox is busy
+static void SendArrivalsRequest(AppData* appdata, 
+                                const int32_t bus_list_index) {
+  if(!SendAppMessageArrivalsRequest(&appdata->buses, bus_list_index)) {
+    s_request_transaction_id = s_transaction_id;
+    s_request_bus_list_index = bus_list_index;
+    app_timer_register(APP_MESSAGE_RETRY_TIMEOUT, 
+                       SendArrivalsRequestCallback, 
+                       appdata);
+  }
+}
+
+static void SendArrivalsRequestCallback(void* context) {
+  // the transaction may have been replaced while waiting
+  if(s_request_transaction_id == s_transaction_id) {
+    SendArrivalsRequest(context, s_request_bus_list_index);
   }
 }
 
@@ -248,70 +625,69 @@ static void SendAppMessageUpdateArrivals(AppData* appdata) {
 
   Buses* buses = &appdata->buses;
 
+  // let the phone filter the buses against its own location if asked to,
+  // or if there's no location here yet; saves waiting on a location
+#ifdef FILTER_ON_PHONE
+  s_phone_filter = true;
+#else
+  s_phone_filter = (s_cached_lat == CONST_0) || (s_cached_lon == CONST_0);
+#endif
+
+  if(s_phone_filter && (buses->count > 0)) {
+    APP_LOG(APP_LOG_LEVEL_INFO,
+            "----Initiated transaction id: %u (phone filter)",
+            (uint)s_transaction_id);
+
+    // the phone reports how many nearby buses there are
+    s_outstanding_requests = 1;
+    s_arrivals_transaction = true;
+    ExtendTransactionDeadline();
+    SeedNextArrivals(appdata, buses->count);
+    SendArrivalsRequest(appdata, NO_BUS_LIST);
+    return;
+  }
+
   // make sure any new/removed buses are (in)visible as they should be
   FilterBusesByCachedLocation(buses);
 
-  // build the strings of stop/route pairs
-  char* busList = NULL;
-  for(uint i = 0; i < buses->filter_count; i++) {
-    uint32_t b = buses->filter_index[i];
-    if(b >= buses->count) {
-      APP_LOG(APP_LOG_LEVEL_ERROR, 
-              "Critical error! Filtered bus index out of range.");
-      return;
-    }
-    char* stop = buses->data[b].stop_id;
-    char* route = buses->data[b].route_id;
-    char* bus = NULL;
-    if(busList == NULL) {
-      uint size = strlen(stop)+strlen(route)+2;
-      bus = malloc(size);
-      snprintf(bus, size, "%s,%s", stop, route);
-    }
-    else {
-      uint size = strlen(busList)+strlen(stop)+strlen(route)+3;
-      bus = malloc(size);
-      snprintf(bus, size, "%s|%s,%s", busList, stop, route);
-    }
-    
-    free(busList);
-    busList = bus;
+  // the phone keeps its own copy of the buses; only the nearby ones are
+  // requested
+  uint32_t bus_count = 0;
+  for(uint32_t b = BusesFilterFirst(buses); 
+      b < buses->count; 
+      b = BusesFilterNext(buses, b)) {
+    bus_count += 1;
   }
 
-  if(busList != NULL) {
+  if(bus_count > 0) {
     // s_transaction_id += 1;
     APP_LOG(APP_LOG_LEVEL_INFO,
             "----Initiated transaction id: %u",
             (uint)s_transaction_id);
 
-    s_outstanding_requests = buses->filter_count;
-    
-    // Prepare dictionary
-    DictionaryIterator *iterator;
-    app_message_outbox_begin(&iterator);
-
-    // Write data
-    dict_write_uint32(iterator, kAppMessageMessageType, kAppMessageArrivalTime);
-    dict_write_cstring(iterator, kAppMessagebusList, busList);
-    dict_write_uint32(iterator, kAppMessageTransactionId, s_transaction_id);
-
-    // Send data
-    app_message_outbox_send();
-    
-    free(busList);
+    s_outstanding_requests = bus_count;
+    s_arrivals_transaction = true;
+    ExtendTransactionDeadline();
+    SeedNextArrivals(appdata, bus_count);
+    SendArrivalsRequest(appdata, NO_BUS_LIST);
   }
   else {
+    if(s_location_stale) {
+      // nothing else is being sent; check the last known location now
+      SendAppMessageRevalidateLocation();
+    }
+
     // no nearby buses to update
-    APP_LOG(APP_LOG_LEVEL_INFO, 
-        "----Completed transaction id: %u",
-        (uint)s_transaction_id);
-    // mark the app as initialized; 
-    appdata->initialized = true;
-    MainWindowUpdateArrivals(appdata);
+    s_live_transaction_id = 0;
+    CompleteArrivalsTransaction(appdata);
   }
 }
 
 void UpdateArrivals(AppData* appdata) {
+  // the live arrivals were thrown away, or didn't come from the phone
+  if(appdata->refresh_arrivals || appdata->arrivals_stale) {
+    s_live_transaction_id = 0;
+  }
   appdata->refresh_arrivals = false;
   ArrivalsDestructor(appdata->next_arrivals);
 
@@ -329,62 +705,85 @@ void UpdateArrivals(AppData* appdata) {
   }
 }
 
-static void HandleAppMessageArrivalTime(DictionaryIterator *iterator,
+// Each message carries a batch of arrivals, packed ArrivalRecords read in
+// place from the inbox, and the number of buses whose arrivals are now 
+// complete. Batches are numbered; a batch seen before is ignored, and a 
+// gap asks the phone to send the batches again from the missing one.
+static void HandleAppMessageArrivalTime(const Message* message,
                                         void *context) {
 
-  Tuple *stop_id_tuple = dict_find(iterator, kAppMessageStopId);
-  Tuple *route_id_tuple = dict_find(iterator, kAppMessageRouteId);
-  Tuple *arrival_delta_tuple = dict_find(iterator, kAppMessageArrivalDelta);
-  Tuple *scheduled_tuple = dict_find(iterator, kAppMessageScheduled);
-  Tuple *predicted_tuple = dict_find(iterator, kAppMessagePredicted);
-  Tuple *arrivalCode_tuple = dict_find(iterator, kAppMessageArrivalCode);
-  Tuple *arrival_delta_string_tuple = dict_find(iterator, 
-      kAppMessageArrivalDeltaString);
-  Tuple *transaction_id_tuple = dict_find(iterator, kAppMessageTransactionId);
-  Tuple *items_remaining_tuple = dict_find(iterator, kAppMessageItemsRemaining);
-  Tuple *trip_id_tuple = dict_find(iterator, kAppMessageTripId);
-
-  // TODO; stop passing bus index around.
-  if(stop_id_tuple && route_id_tuple && arrival_delta_tuple &&
-     scheduled_tuple && predicted_tuple && arrivalCode_tuple &&
-     arrival_delta_string_tuple && transaction_id_tuple && 
-     items_remaining_tuple && trip_id_tuple) {
+  if(MessageHasKeys(message, MESSAGE_REQUIRED_ARRIVAL_TIME)) {
 
     AppData* appdata = context;
 
     // active transaction?
-    if(transaction_id_tuple->value->uint32 == s_transaction_id) {
-      // completed request check
-      if(items_remaining_tuple->value->uint32 == 0) {
-        if(s_outstanding_requests > 0) {
-          s_outstanding_requests -= 1;
+    if(message->transaction_id == s_transaction_id) {
+      if(message->sequence != s_next_sequence) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, 
+                "Arrivals batch %u, expected %u",
+                (uint)message->sequence,
+                (uint)s_next_sequence);
+        if(message->sequence > s_next_sequence) {
+          SendAppMessageArrivalsResend();
         }
-        APP_LOG(APP_LOG_LEVEL_INFO, "Requests outstanding: %u",
-          (uint)s_outstanding_requests);
+        return;
+      }
+      s_next_sequence += 1;
+      s_resend_requested = false;
+      ExtendTransactionDeadline();
+
+      // the phone filtered the buses
+      if(message->bus_filter != NULL) {
+        BusesSetFilterBitmap(message->bus_filter, 
+                             message->bus_filter_size, 
+                             &appdata->buses);
+      }
+
+      // the phone sends everything if it couldn't send just the changes
+      if(s_next_arrivals_seeded && (message->base_transaction_id == 0)) {
+        ArrivalsDestructor(appdata->next_arrivals);
+        s_next_arrivals_seeded = false;
+      }
+
+      // the arrival list is left out of batches that only complete buses
+      if(message->arrival_list != NULL) {
+        time_t now = time(NULL);
+
+        for(uint16_t i = 0; i < message->arrival_count; i++) {
+          const ArrivalRecord* r = &message->arrival_list[i];
+          if(r->arrival_code == ARRIVAL_CODE_REMOVED) {
+            RemoveArrival(r->bus_index, r->trip_id, appdata->next_arrivals);
+            continue;
+          }
+          int32_t arrival_time = (r->predicted != 0) ? 
+                                 r->predicted : r->scheduled;
+          AddArrival(r->bus_index,
+                     r->trip_id,
+                     r->scheduled,
+                     r->predicted,
+                     arrival_time - now,
+                     r->arrival_code,
+                     &appdata->buses,
+                     appdata->next_arrivals);
+        }
+      }
+
+      // completed request check; when the phone filters, it counts the
+      // buses that remain
+      if(MessageHasKeys(message, MESSAGE_KEY(kAppMessageItemsRemaining))) {
+        s_outstanding_requests = message->items_remaining;
       }
       else {
-        // add the arrival if completion is not signaled
-        AddArrival(stop_id_tuple->value->cstring,
-                   route_id_tuple->value->cstring,
-                   trip_id_tuple->value->cstring,
-                   scheduled_tuple->value->cstring,
-                   predicted_tuple->value->cstring,
-                   arrival_delta_string_tuple->value->cstring,
-                   arrival_delta_tuple->value->int32,
-                   *(arrivalCode_tuple->value->cstring),
-                   &appdata->buses,
-                   appdata->next_arrivals);
-        // APP_LOG(APP_LOG_LEVEL_INFO, "Items remaining: %u",
-        //   (uint)items_remaining_tuple->value->uint32);
+        uint32_t completed = message->count;
+        s_outstanding_requests -= (completed < s_outstanding_requests) ? 
+                                  completed : s_outstanding_requests;
       }
+      APP_LOG(APP_LOG_LEVEL_INFO, "Requests outstanding: %u",
+        (uint)s_outstanding_requests);
 
       if(s_outstanding_requests == 0) {
-        APP_LOG(APP_LOG_LEVEL_INFO, 
-                "----Completed transaction id: %u",
-                (uint)s_transaction_id);
-
-        appdata->initialized = true;
-        MainWindowUpdateArrivals(appdata);
+        s_live_transaction_id = s_transaction_id;
+        CompleteArrivalsTransaction(appdata);
       }
     }
   }
@@ -393,28 +792,33 @@ static void HandleAppMessageArrivalTime(DictionaryIterator *iterator,
   }
 }
 
-static void HandleAppMessageNearbyStops(DictionaryIterator *iterator,
+// The phone's copy of the buses is out of date; send the list, in parts 
+// the phone asks for one at a time
+static void HandleAppMessageBusesSync(const Message* message,
+                                      void *context) {
+  if(MessageHasKeys(message, MESSAGE_REQUIRED_BUSES_SYNC)) {
+    AppData* appdata = context;
+    if(message->transaction_id == s_transaction_id) {
+      ExtendTransactionDeadline();
+      // the phone starts over if the buses changed under it
+      uint16_t index = 
+          (message->index < appdata->buses.count) ? message->index : 0;
+      SendArrivalsRequest(appdata, index);
+    }
+  }
+  else {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Missing data - kAppMessageBusesSync!");
+  }
+}
+
+static void HandleAppMessageNearbyStops(const Message* message,
                                         void *context) {
       
-  Tuple *stop_id_tuple = dict_find(iterator, kAppMessageStopId);
-  Tuple *items_remaining_tuple = dict_find(iterator, kAppMessageItemsRemaining);
-  Tuple *stop_name_tuple = dict_find(iterator, kAppMessageStopName);
-  Tuple *route_list_string_tuple = dict_find(iterator, 
-      kAppMessageRouteListString);
-  Tuple *lat_tuple = dict_find(iterator, kAppMessageLat);
-  Tuple *lon_tuple = dict_find(iterator, kAppMessageLon);
-  Tuple *direction_tuple = dict_find(iterator, kAppMessageDirection);
-  Tuple *transaction_id_tuple = dict_find(iterator, kAppMessageTransactionId);
-  Tuple *index_tuple = dict_find(iterator, kAppMessageIndex);
-  Tuple *count_tuple = dict_find(iterator, kAppMessageCount);
-      
-  if(stop_id_tuple && items_remaining_tuple && stop_name_tuple &&
-     route_list_string_tuple && lat_tuple && lon_tuple && count_tuple &&
-     direction_tuple && transaction_id_tuple && index_tuple) {
+  if(MessageHasKeys(message, MESSAGE_REQUIRED_NEARBY_STOPS)) {
 
     AppData* appdata = context;
     // active transaction?
-    if((transaction_id_tuple->value->uint32 == s_transaction_id) && 
+    if((message->transaction_id == s_transaction_id) && 
         (s_nearby_stops->memlist != NULL)) {
 
       // TODO: A better way to resolve this would be to up the transaction
@@ -423,31 +827,28 @@ static void HandleAppMessageNearbyStops(DictionaryIterator *iterator,
       // but then cancels out... don't want the settings showing up after
       // they've been canceled
       
-      s_nearby_stops->total_size = count_tuple->value->uint16;
+      s_nearby_stops->total_size = message->count;
 
-      if(count_tuple->value->uint16 == 0) {
+      if(message->count == 0) {
         // special case: no stops returned
         AddStopsUpdate(s_nearby_stops, &appdata->buses);
       }
       else {
-        double lat, lon;
-        memcpy(&lat, lat_tuple->value->data, sizeof(double));
-        memcpy(&lon, lon_tuple->value->data, sizeof(double));
-        sll sll_lat = dbl2sll(lat);
-        sll sll_lon = dbl2sll(lon);
+        sll sll_lat = dbl2sll(message->lat);
+        sll sll_lon = dbl2sll(message->lon);
                 
-        AddStop(index_tuple->value->uint16,
-                stop_id_tuple->value->cstring,
-                stop_name_tuple->value->cstring, 
-                route_list_string_tuple->value->cstring,
+        AddStop(message->index,
+                message->stop_id,
+                message->stop_name, 
+                message->route_list_string,
                 sll_lat, 
                 sll_lon, 
-                direction_tuple->value->cstring, 
+                message->direction, 
                 s_nearby_stops);
 
         APP_LOG(APP_LOG_LEVEL_INFO, "Items remaining: %u",
-            (uint)items_remaining_tuple->value->uint16);
-        if(items_remaining_tuple->value->uint16 == 0) {
+            (uint)message->items_remaining);
+        if(message->items_remaining == 0) {
           AddStopsUpdate(s_nearby_stops, &appdata->buses);
         }
       }
@@ -466,23 +867,14 @@ static void HandleAppMessageNearbyStops(DictionaryIterator *iterator,
   }
 }
 
-static void HandleAppMessageNearbyRoutes(
-    DictionaryIterator *iterator,
-    void *context,
-    const uint32_t message_type) {
+static void HandleAppMessageNearbyRoutes(const Message* message,
+                                         void *context) {
       
-  Tuple *items_remaining_tuple = dict_find(iterator, kAppMessageItemsRemaining);
-  Tuple *route_id_tuple = dict_find(iterator, kAppMessageRouteId);
-  Tuple *route_name_tuple = dict_find(iterator, kAppMessageRouteName);
-  Tuple *description_tuple = dict_find(iterator, kAppMessageDescription);
-  Tuple *transaction_id_tuple = dict_find(iterator, kAppMessageTransactionId);
-
-  if(items_remaining_tuple && route_id_tuple && route_name_tuple
-     && description_tuple && transaction_id_tuple) {
+  if(MessageHasKeys(message, MESSAGE_REQUIRED_NEARBY_ROUTES)) {
 
     // AppData* appdata = context;
     // active transaction? user canceled settings menu?
-    if(transaction_id_tuple->value->uint32 == s_transaction_id) {
+    if(message->transaction_id == s_transaction_id) {
        
       // TODO: A better way to resolve this would be to up the transaction
       // id upon canceled transactions instead of checking to see if 
@@ -490,7 +882,7 @@ static void HandleAppMessageNearbyRoutes(
       // but then cancels out... don't want the settings showing up after
       // they've been canceled
 
-      uint32_t items = items_remaining_tuple->value->uint32;
+      uint32_t items = message->items_remaining;
 
       APP_LOG(APP_LOG_LEVEL_INFO, 
               "HandleAppMessageNearbyRoutes - items %u", 
@@ -506,9 +898,9 @@ static void HandleAppMessageNearbyRoutes(
         AddRoutesUpdate(s_nearby_routes, &appdata->buses);
       }
       else {
-        AddRoute(route_id_tuple->value->cstring, 
-                 route_name_tuple->value->cstring, 
-                 description_tuple->value->cstring,
+        AddRoute(message->route_id, 
+                 message->route_name, 
+                 message->description,
                  false,
                  &s_nearby_routes);
       }
@@ -523,38 +915,62 @@ static void HandleAppMessageNearbyRoutes(
   }
 }
 
-static void HandleAppMessageLocation(DictionaryIterator *iterator,
+static void HandleAppMessageLocation(const Message* message,
                                      void *context) {
 
-  Tuple *lat_tuple = dict_find(iterator, kAppMessageLat);
-  Tuple *lon_tuple = dict_find(iterator, kAppMessageLon);
-
-  if(lat_tuple && lon_tuple) {
-    double lat, lon;
-    memcpy(&lat, lat_tuple->value->data, sizeof(double));
-    memcpy(&lon, lon_tuple->value->data, sizeof(double));
-    s_cached_lat = dbl2sll(lat);
-    s_cached_lon = dbl2sll(lon);
+  if(MessageHasKeys(message, MESSAGE_REQUIRED_LOCATION)) {
+    s_cached_lat = dbl2sll(message->lat);
+    s_cached_lon = dbl2sll(message->lon);
+    s_cached_time = time(NULL);
+    s_location_dirty = true;
+    // a fix replacing the last known location is as good as the one asked 
+    // for to check it
+    bool revalidating = s_location_revalidating || s_location_stale;
+    s_location_stale = false;
 
     AppData* appdata = context;
 
-    s_outstanding_requests = 0;
+    if(s_location_requested) {
+      s_location_requested = false;
+      s_outstanding_requests = 0;
 
-    // update bus arrival time
-    UpdateArrivals(appdata);
+      // update bus arrival time
+      UpdateArrivals(appdata);
+    }
+    else {
+      // the phone moved, or a fresh fix replaced the last known location;
+      // only refresh if the nearby buses changed. A phone push waits for
+      // the current transaction, a fresh fix restarts it.
+      s_location_revalidating = false;
+#ifdef FILTER_ON_PHONE
+      // the phone only pushes a location when it has moved far enough
+      bool changed = true;
+#else
+      bool changed = 
+          RefilterBusesByLocation(s_cached_lat, s_cached_lon, &appdata->buses);
+#endif
+      // the first location also completes initialization when there 
+      // were no buses to get arrivals for
+      bool idle = (s_outstanding_requests == 0);
+      if((s_timer != NULL) &&
+         !appdata->refresh_arrivals &&
+         ((changed && (revalidating || idle)) || 
+          (idle && !appdata->initialized))) {
+        APP_LOG(APP_LOG_LEVEL_INFO, "Location moved - updating arrivals");
+        UpdateArrivals(appdata);
+      }
+    }
   }
   else {
     APP_LOG(APP_LOG_LEVEL_ERROR, "Missing data - kAppMessageLocation!");
   }
 }
 
-static void HandleAppMessageError(DictionaryIterator *iterator,
+static void HandleAppMessageError(const Message* message,
                                   void *context) {
 
-  Tuple *description_tuple = dict_find(iterator, kAppMessageDescription);
-
-  if(description_tuple) {
-    ErrorWindowPush(description_tuple->value->cstring, true);
+  if(message->description != NULL) {
+    ErrorWindowPush(message->description, true);
   }
   else {
     ErrorWindowPush(DIALOG_MESSAGE_GENERAL_ERROR, true);
@@ -564,27 +980,30 @@ static void HandleAppMessageError(DictionaryIterator *iterator,
 static void InboxReceivedCallback(DictionaryIterator *iterator,
                                   void *context) {
 
-  Tuple *message_type_tuple = dict_find(iterator, kAppMessageMessageType);
+  // walk the dictionary once, rather than once per key
+  Message message;
+  MessageDecode(iterator, &message);
   
-  if(message_type_tuple) {
-    uint32_t message_type = message_type_tuple->value->uint32;
-
-    switch(message_type) {
+  if(MessageHasKeys(&message, MESSAGE_KEY(kAppMessageMessageType))) {
+    switch(message.message_type) {
       case kAppMessageArrivalTime:
-        HandleAppMessageArrivalTime(iterator, context);
+        HandleAppMessageArrivalTime(&message, context);
         break;
       case kAppMessageNearbyStops:
-        HandleAppMessageNearbyStops(iterator, context);
+        HandleAppMessageNearbyStops(&message, context);
         break;
       case kAppMessageNearbyRoutes:
       case kAppMessageRoutesForStop:
-        HandleAppMessageNearbyRoutes(iterator, context, message_type);
+        HandleAppMessageNearbyRoutes(&message, context);
         break;
       case kAppMessageLocation:
-        HandleAppMessageLocation(iterator, context);
+        HandleAppMessageLocation(&message, context);
         break;
       case kAppMessageError:
-        HandleAppMessageError(iterator, context);
+        HandleAppMessageError(&message, context);
+        break;
+      case kAppMessageBusesSync:
+        HandleAppMessageBusesSync(&message, context);
         break;
       default:
         APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid message type received!");
@@ -598,6 +1017,9 @@ static void InboxReceivedCallback(DictionaryIterator *iterator,
 
 static void InboxDroppedCallback(AppMessageResult reason, void *context) {
   APP_LOG(APP_LOG_LEVEL_ERROR, "Incoming message dropped!");
+  // it may have been an arrivals batch; if it was the last one, no later
+  // batch would show the gap, so ask for it again now
+  SendAppMessageArrivalsResend();
   // APP_LOG(APP_LOG_LEVEL_INFO, 
   //         "In dropped: %i - %s",
   //         reason, 
@@ -621,6 +1043,11 @@ static void OutboxFailedCallback(DictionaryIterator *iterator,
 
 static void OutboxSentCallback(DictionaryIterator *iterator, void *context) {
   APP_LOG(APP_LOG_LEVEL_INFO, "Outbox send success!");
+
+  if(s_location_stale) {
+    // arrivals were requested for the last known location; now get a fix
+    SendAppMessageRevalidateLocation();
+  }
 }
 
 void CommunicationInit(AppData* appdata) {
@@ -628,10 +1055,44 @@ void CommunicationInit(AppData* appdata) {
   RoutesConstructor(&s_nearby_routes);
   s_cached_lat = CONST_0;
   s_cached_lon = CONST_0;
+  s_cached_time = 0;
   s_outstanding_requests = 0;
+  s_arrivals_transaction = false;
+  s_location_requested = false;
+  s_location_revalidating = false;
+  s_location_stale = false;
+  s_location_dirty = false;
+  s_phone_filter = false;
+  s_live_transaction_id = 0;
+  s_next_arrivals_seeded = false;
   s_transaction_id = 0;
-  s_skipped_arrival_updates = 0;
-  s_last_outstanding_request_at_skipped = 0;
+  s_transaction_deadline = 0;
+  s_transaction_resent = false;
+  s_next_sequence = 0;
+  s_resend_requested = false;
+  s_resend_timer = NULL;
+  s_predictions_volatile = false;
+  s_appdata = appdata;
+  s_app_focused = true;
+  s_refresh_suspended = false;
+
+  // refreshes follow the user's attention and the battery
+  app_focus_service_subscribe(AppFocusCallback);
+  accel_tap_service_subscribe(AccelTapCallback);
+  battery_state_service_subscribe(BatteryStateCallback);
+  BatteryStateCallback(battery_state_service_peek());
+
+  // start from the last known location, if it's recent enough; it gets
+  // checked against a fresh fix once the first arrivals are requested
+  sll lat, lon;
+  time_t fix_time;
+  if(PersistReadLocation(&lat, &lon, &fix_time) &&
+     (time(NULL) - fix_time < PERSIST_LOCATION_MAX_AGE)) {
+    s_cached_lat = lat;
+    s_cached_lon = lon;
+    s_cached_time = fix_time;
+    s_location_stale = true;
+  }
   
     // Register callbacks
   app_message_set_context(appdata);
@@ -640,12 +1101,20 @@ void CommunicationInit(AppData* appdata) {
   app_message_register_outbox_failed(OutboxFailedCallback);
   app_message_register_outbox_sent(OutboxSentCallback);
 
-  // Open app message
-  app_message_open(1024, 1024);
+  // Open app message; the inbox is as large as possible so the phone can
+  // batch as many arrivals as fit into each message
+  s_inbox_size = app_message_inbox_size_maximum();
+  app_message_open(s_inbox_size, APP_MESSAGE_OUTBOX_SIZE);
 }
 
 void CommunicationDeinit() {
   StopArrivalsUpdateTimer();
+  app_focus_service_unsubscribe();
+  accel_tap_service_unsubscribe();
+  battery_state_service_unsubscribe();
+  if(s_location_dirty) {
+    PersistWriteLocation(s_cached_lat, s_cached_lon, s_cached_time);
+  }
   RoutesDestructor(&s_nearby_routes);
   app_message_deregister_callbacks();
 }
\ No newline at end of file
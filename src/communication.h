@@ -8,6 +8,12 @@
 #define DIALOG_MESSAGE_BLUETOOTH_ERROR "Bluetooth Disconnected\n\nReconnect phone to continue"
 #define DIALOG_MESSAGE_GENERAL_ERROR "Something went wrong\n\nSorry - Please try again"
 
+// large enough to sync a long list of favorites with the phone
+#define APP_MESSAGE_OUTBOX_SIZE 2048
+// the list of favorites is synced in parts of up to this many bytes, 
+// leaving room for the rest of the arrivals request
+#define BUS_LIST_MAX_SIZE 1536
+
 // AppMessage dictionary keys
 enum AppMessageKeys {
   kAppMessageMessageType = 0,
@@ -33,7 +39,13 @@ enum AppMessageKeys {
   kAppMessageArrivalDeltaString,
   kAppMessageIndex,
   kAppMessageCount,
-  kAppMessageRadius
+  kAppMessageRadius,
+  kAppMessageArrivalList,
+  kAppMessageInboxSize,
+  kAppMessageBusesVersion,
+  kAppMessageBusFilter,
+  kAppMessageBaseTransactionId,
+  kAppMessageSequence
 };
 
 // Enumerations for kAppMessageMessageType
@@ -45,9 +57,47 @@ enum AppMessageType {
   kAppMessageNearbyRoutes,
   kAppMessageLocation,
   kAppMessageError,
-  kAppMessageRoutesForStop
+  kAppMessageRoutesForStop,
+  kAppMessageBusesSync,
+  kAppMessageArrivalsResend
 };
 
+// ms between arrival refreshes, picked from the arrivals shown; see 
+// NextRefreshInterval()
+#ifndef REFRESH_INTERVAL_FAST
+#define REFRESH_INTERVAL_FAST 15000
+#endif
+#ifndef REFRESH_INTERVAL_NORMAL
+#define REFRESH_INTERVAL_NORMAL 30000
+#endif
+#ifndef REFRESH_INTERVAL_SLOW
+#define REFRESH_INTERVAL_SLOW 180000
+#endif
+// a bus arriving within this many seconds is refreshed quickly
+#define REFRESH_NEAR_ARRIVAL (5*SECONDS_PER_MINUTE)
+// predictions further out than this many seconds are refreshed slowly
+#define REFRESH_FAR_ARRIVAL (20*SECONDS_PER_MINUTE)
+// a prediction moving by this many seconds in one refresh is volatile
+#define REFRESH_VOLATILE_PREDICTION 60
+// the refresh interval is multiplied by this when the battery is low
+#define REFRESH_BATTERY_LOW_FACTOR 2
+#define REFRESH_BATTERY_LOW_PERCENT 20
+// seconds since the last refresh before a wrist flick refreshes right away
+#define REFRESH_TAP_IDLE 60
+// seconds without progress before an arrivals transaction has stalled; the
+// missing arrivals are asked for again once before starting over
+#define ARRIVALS_TRANSACTION_TIMEOUT 30
+
+// Arrival record as packed by the phone into the kAppMessageArrivalList
+// byte array (little endian)
+typedef struct {
+  uint8_t bus_index;
+  uint32_t trip_id;    // StringHash() of the OBA trip id
+  int32_t scheduled;   // epoch seconds
+  int32_t predicted;   // epoch seconds, 0 if no prediction is available
+  char arrival_code;
+} __attribute__((__packed__)) ArrivalRecord;
+
 void CommunicationInit(AppData* appdata);
 void CommunicationDeinit();
 void StartArrivalsUpdateTimer(AppData* appdata);
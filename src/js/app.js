@@ -7,6 +7,8 @@
 var servers = require('./servers').servers;
 var OBA_SERVER = '';
 var OBA_API_KEY = '';
+var OBA_ARRIVALS_QUERY = ''; // see arrivalsQuery()
+var OBA_ARRIVALS_OPTIONS = null; // see arrivalsOptions()
 
 // import test data
 // TODO: don't make this a 'require' find a better way to do test 'hooks'
@@ -20,16 +22,64 @@ var DIALOG_INTERNET_ERROR =
     "Connection failure\n\nCheck phone internet connection";
 var GPS_TIMEOUT = 15000;
 var GPS_MAX_AGE = 60000;
+var LOCATION_PUSH_DISTANCE = 0.1; // km moved before pushing a new location
 var APP_MESSAGE_MAX_ATTEMPTS = 7;
 var APP_MESSAGE_TIMEOUT = 2000;
 var HTTP_MAX_ATTEMPTS = 7;
 var HTTP_RETRY_TIMEOUT = 2000;
 var HTTP_REQUEST_TIMEOUT = 7500;
-
+var ARRIVALS_FETCH_CONCURRENCY = 4; // OBA arrivals requests at once
+var ARRIVALS_CACHE_TTL = 10000; // ms an OBA arrivals response is reused for
+var ARRIVALS_CACHE_MAX_ENTRIES = 20;
+// arrivals asked of OBA, unless overridden by the server in servers.js
+var ARRIVALS_MINUTES_BEFORE = 2;
+var ARRIVALS_MINUTES_AFTER = 35; // no more than the OBA default of 35
+var ARRIVALS_INCLUDE_REFERENCES = false;
+// arrivals sent for each bus; see ARRIVALS_PER_BUS in arrivals.h
+var ARRIVALS_PER_BUS = 3;
+// AppMessage dictionary overhead of an arrivals batch: header, 6 tuple
+// headers and 5 integers
+var TUPLE_HEADER_SIZE = 7;
+var ARRIVAL_BATCH_OVERHEAD = 1 + 6*TUPLE_HEADER_SIZE + 5*4;
+// extra overhead when filtering on the phone: the itemsRemaining tuple, and
+// the busFilter tuple's header
+var ARRIVAL_FILTER_OVERHEAD = 2*TUPLE_HEADER_SIZE + 4;
+// size of a packed arrival record; see ArrivalRecord in communication.h
+var ARRIVAL_RECORD_SIZE = 14;
+// the record's bus index is a single byte
+var ARRIVAL_RECORD_MAX_BUS_INDEX = 255;
+// arrival code telling the watch to drop an arrival; see arrivals.h
+var ARRIVAL_CODE_REMOVED = 'x';
+
+// OBA arrivals responses by stop, kept across transactions for
+// ARRIVALS_CACHE_TTL - see cacheArrivals()
 var arrivalsJsonCache = {};
+// OBA arrivals requests - see fetchArrivalsForStop()
+var arrivalsFetches = {}; // transactions waiting on each url being fetched
+var arrivalsFetchQueue = [];
+var arrivalsFetchCount = 0;
 var stopsJsonCache = {};
 var currentTransaction = -1;
 
+// the arrivals the watch last received in full - see createArrivalsBatch()
+var sentArrivals = null;
+// the arrivals batch being sent - see resendArrivalsBatches()
+var arrivalsBatch = null;
+
+// the OBA server last picked - see loadObaServer()
+var OBA_SERVER_STORAGE_KEY = 'obaServer';
+
+// copy of the watch's buses - see saveFavorites()
+var FAVORITES_STORAGE_KEY = 'favorites';
+var favorites = null;
+// the watch's buses being received in parts - see receiveFavorites()
+var pendingFavorites = null;
+
+// location tracking state - see getLocation()
+var locationWatchId = null;
+var locationRequested = false;
+var lastSentLocation = null;
+
 /** Extend Number object with method to convert numeric degrees to radians */
 if (Number.prototype.toRadians === undefined) {
     Number.prototype.toRadians = function() { return this * Math.PI / 180; };
@@ -55,11 +105,54 @@ function DistanceBetween(lat1, lon1, lat2, lon2) {
 }
 
 /**
- * Sets the global OBA_SERVER and OBA_API_KEY vars to that of the closest
- * server to (lat, lon)
+ * Get what the arrivals requests to 'server' ask for: its 'arrivals'
+ * overrides from servers.js, or the defaults
+ */
+function arrivalsOptions(server) {
+  var options = server.arrivals || {};
+  return {
+    'minutesBefore': options.minutesBefore !== undefined ?
+                     options.minutesBefore : ARRIVALS_MINUTES_BEFORE,
+    'minutesAfter': options.minutesAfter !== undefined ?
+                    options.minutesAfter : ARRIVALS_MINUTES_AFTER,
+    'includeReferences': options.includeReferences !== undefined ?
+                         options.includeReferences :
+                         ARRIVALS_INCLUDE_REFERENCES
+  };
+}
+
+/**
+ * Build the query string of the arrivals requests from 'options', asking
+ * only for the arrivals the watch can show
+ */
+function arrivalsQuery(options) {
+  var query = '&minutesBefore=' + options.minutesBefore +
+              '&minutesAfter=' + options.minutesAfter;
+  if(!options.includeReferences) {
+    query += '&includeReferences=false';
+  }
+  return query;
+}
+
+/**
+ * Sets the global OBA_SERVER, OBA_API_KEY, OBA_ARRIVALS_OPTIONS and
+ * OBA_ARRIVALS_QUERY vars to that of 'server'
+ */
+function setObaServer(server) {
+  OBA_SERVER = server;
+  OBA_API_KEY = servers[server].key;
+  OBA_ARRIVALS_OPTIONS = arrivalsOptions(servers[server]);
+  OBA_ARRIVALS_QUERY = arrivalsQuery(OBA_ARRIVALS_OPTIONS);
+  console.log("Setting OBA server: " + OBA_SERVER);
+}
+
+/**
+ * Sets the OBA server to the closest server to (lat, lon), and remembers it
+ * for the next launch
  */
 function setObaServerByLocation(lat, lon) {
   var distance = -1;
+  var closest = null;
   for(var server in servers) {
     var server_distance = DistanceBetween(lat,
                                           lon,
@@ -68,11 +161,38 @@ function setObaServerByLocation(lat, lon) {
     console.log(server + " distance: " + server_distance);
     if((distance == -1) || (server_distance < distance)) {
       distance = server_distance;
-      OBA_SERVER = server;
-      OBA_API_KEY = servers[server].key;
+      closest = server;
     }
   }
-  console.log("Setting OBA server: " + OBA_SERVER);
+  if(closest !== null) {
+    setObaServer(closest);
+    localStorage.setItem(OBA_SERVER_STORAGE_KEY, closest);
+  }
+}
+
+/**
+ * Sets the OBA server to the one picked last time, so the watch's first
+ * arrivals request needn't wait for a location
+ */
+function loadObaServer() {
+  var server = localStorage.getItem(OBA_SERVER_STORAGE_KEY);
+  if(server && servers.hasOwnProperty(server)) {
+    setObaServer(server);
+  }
+}
+
+/**
+ * Calls 'callback' once there's an OBA server to ask; only needs a location
+ * if no server has been picked yet
+ */
+function withObaServer(callback) {
+  if(OBA_SERVER !== '') {
+    callback();
+    return;
+  }
+  withCurrentLocation(function(coords) {
+    callback();
+  });
 }
 
 /** Convert a decimal value to a C-compatible 'double' byte array */
@@ -96,8 +216,11 @@ function randomIntFromInterval(min,max) {
   return Math.floor(Math.random()*(max-min+1)+min);
 }
 
-/** Send an AppMessage dictionary to the watch */
-function sendAppMessage(dictionary, successFunction) {
+/**
+ * Send an AppMessage dictionary to the watch, calling 'failureFunction' (if
+ * given) once all attempts have failed
+ */
+function sendAppMessage(dictionary, successFunction, failureFunction) {
   var attempts = 0;
 
   function send() {
@@ -118,6 +241,9 @@ function sendAppMessage(dictionary, successFunction) {
     else {
       console.log("sendAppMessage: Failed sending AppMessage. Bailing." +
                   "Content:" + JSON.stringify(dictionary));
+      if(failureFunction) {
+        failureFunction();
+      }
     }
   }
 
@@ -141,8 +267,11 @@ function sendError(message) {
   sendAppMessage(dictionary, function() { });
 }
 
-/** Web request with backoff and retry */
-function xhrRequest(url, type, callback) {
+/**
+ * Web request with backoff and retry, calling 'failure' (if given) once all
+ * attempts have failed
+ */
+function xhrRequest(url, type, callback, failure) {
   var attempts = 0;
 
   function xhrRequestRetry() {
@@ -156,6 +285,9 @@ function xhrRequest(url, type, callback) {
       console.log('xhrRequest: Failed after ' + attempts +
                   ' attempts. Bailing.');
       sendError(DIALOG_INTERNET_ERROR  + "\n\n0x0000");
+      if(failure) {
+        failure();
+      }
     }
   }
 
@@ -187,100 +319,283 @@ function xhrRequest(url, type, callback) {
   xhrRequestDo();
 }
 
-function sign(x) { return x > 0 ? '' : x < 0 ? '-' : ''; }
+/** Convert milliseconds to whole seconds, as sent to the watch */
+function millisToSeconds(millis) {
+  return Math.round(millis / 1000);
+}
 
-function millisToMinutesAndSeconds(millis) {
-  var m = Math.abs(millis);
-  var minutes = Math.floor(m / 60000);
-  var seconds = ((m % 60000) / 1000).toFixed(0);
-  return sign(millis) + minutes + ":" + (seconds < 10 ? '0' : '') + seconds;
+/**
+ * 32 bit FNV-1a hash of the UTF-8 bytes of 'string'; matches StringHash() on
+ * the watch
+ */
+function stringHash(string) {
+  var bytes = unescape(encodeURIComponent(string));
+  var hash = 2166136261;
+  for(var i = 0; i < bytes.length; i++) {
+    hash ^= bytes.charCodeAt(i);
+    hash = Math.imul(hash, 16777619);
+  }
+  return hash >>> 0;
 }
 
 /**
- * Convert milliseconds into human readable time, subsituting 'Now' for
- * times below |1 min|
+ * Create a batch for sending arrivals to the watch, packing as many arrivals
+ * into each message as fit in the watch's 'inboxSize' byte inbox. If the
+ * watch still shows the arrivals from transaction 'baseTransactionId' only
+ * the arrivals that changed since then are sent.
  */
-function millisToMinutesAndSecondsOba(millis) {
-  var m = Math.abs(millis);
-  var minutes = Math.floor(m / 60000);
-  var seconds = ((m % 60000) / 1000).toFixed(0);
-  if (minutes > 0) {
-    return sign(millis) + minutes + ":" + (seconds < 10 ? '0' : '') + seconds;
+function createArrivalsBatch(transactionId, inboxSize, baseTransactionId) {
+  var base = 0;
+  var previous = null;
+  if(baseTransactionId && sentArrivals &&
+     sentArrivals.transactionId === baseTransactionId &&
+     sentArrivals.version === favorites.version) {
+    base = baseTransactionId;
+    previous = sentArrivals.arrivals;
   }
-  else {
-    return "Now";
+  return {
+    'transactionId': transactionId,
+    'base': base,
+    'previous': previous, // arrivals the watch has, by arrivalKey()
+    'next': {},           // arrivals the watch will have once complete
+    'maxSize': inboxSize - ARRIVAL_BATCH_OVERHEAD,
+    'records': [],
+    'size': 0,
+    'completed': 0,
+    'remaining': null, // buses left to complete, when filtered on the phone
+    'busFilter': null, // bitmap of nearby buses, when filtered on the phone
+    'messages': [], // every message of the transaction, by sequence number
+    'nextMessage': 0,
+    'sending': false,
+    'buses': [],     // buses to get arrivals for, in order
+    'nextBus': 0,    // next bus to add the arrivals of
+    'responses': {}, // OBA arrivals responses fetched so far, by stop
+    'done': false
+  };
+}
+
+/** Key identifying an arrival in the watch's list */
+function arrivalKey(busIndex, tripHash) {
+  return busIndex + ':' + tripHash;
+}
+
+/**
+ * Add an arrival to the batch, skipping it if the watch already has it
+ * unchanged
+ */
+function addArrival(batch, busIndex, tripHash, scheduled, predicted,
+                    arrivalCode) {
+  var key = arrivalKey(busIndex, tripHash);
+  var arrival = [scheduled, predicted, arrivalCode];
+  batch.next[key] = arrival;
+
+  var previous = batch.previous ? batch.previous[key] : undefined;
+  if(previous !== undefined &&
+     previous[0] === scheduled &&
+     previous[1] === predicted &&
+     previous[2] === arrivalCode) {
+    return;
+  }
+  addArrivalRecord(batch, busIndex, tripHash, scheduled, predicted,
+                   arrivalCode);
+}
+
+/**
+ * Leave the arrivals the watch has for 'bus' as they are, rather than
+ * removing them, when its stop couldn't be fetched
+ */
+function keepPreviousArrivals(bus, batch) {
+  if(!batch.previous) {
+    return;
+  }
+  var prefix = bus.busIndex + ':';
+  for(var key in batch.previous) {
+    if(batch.previous.hasOwnProperty(key) && key.indexOf(prefix) === 0) {
+      batch.next[key] = batch.previous[key];
+    }
   }
 }
 
-function formatTimeHHMMA(date) {
-  function minFormat(n){return (n<10?'0':'')+n}
-  var h = date.getHours();
-  return (h%12 || 12) + ':' + 
-      minFormat(date.getMinutes()) + (h<12? 'AM' :'PM');
+/**
+ * Tell the watch to drop the arrivals it has that 'isCurrent' returns false
+ * for, given the bus index and trip hash of each
+ */
+function addRemovedArrivals(batch, isCurrent) {
+  if(!batch.previous) {
+    return;
+  }
+  for(var key in batch.previous) {
+    if(batch.previous.hasOwnProperty(key)) {
+      var parts = key.split(':');
+      var busIndex = Number(parts[0]);
+      var tripHash = Number(parts[1]);
+      if(!isCurrent(busIndex, tripHash)) {
+        addArrivalRecord(batch, busIndex, tripHash, 0, 0,
+                         ARRIVAL_CODE_REMOVED);
+      }
+    }
+  }
 }
 
 /**
- * Sends the completion signal for an arrivals request on specific bus, starts
- * the request for the next bus in the busArray
+ * Tell the watch to drop the arrivals of the buses that aren't being sent
+ * this time
  */
-function completeArrivalsRequest(busArray, transactionId) {
-  // signal completion of this request
+function addRemovedBuses(batch) {
+  var sending = {};
+  for(var i = 0; i < batch.buses.length; i++) {
+    sending[batch.buses[i].busIndex] = true;
+  }
+  addRemovedArrivals(batch, function(busIndex, tripHash) {
+    return sending.hasOwnProperty(busIndex);
+  });
+}
+
+/** Append 'value' to the 'bytes' array as a little endian 32 bit integer */
+function packInt32(bytes, value) {
+  bytes.push(value & 0xFF,
+             (value >>> 8) & 0xFF,
+             (value >>> 16) & 0xFF,
+             (value >>> 24) & 0xFF);
+}
+
+/**
+ * Add an arrival to the batch as a packed ArrivalRecord, sending the batch
+ * first if full
+ */
+function addArrivalRecord(batch, busIndex, tripHash, scheduled, predicted,
+                          arrivalCode) {
+  if(busIndex > ARRIVAL_RECORD_MAX_BUS_INDEX) {
+    // would wrap onto another bus
+    console.log('addArrivalRecord: bus index ' + busIndex + ' too large');
+    return;
+  }
+  if(batch.size > 0 && batch.size + ARRIVAL_RECORD_SIZE > batch.maxSize) {
+    flushArrivalsBatch(batch);
+  }
+  var records = batch.records;
+  records.push(busIndex & 0xFF);
+  packInt32(records, tripHash);
+  packInt32(records, scheduled);
+  packInt32(records, predicted);
+  records.push(arrivalCode.charCodeAt(0));
+  batch.size += ARRIVAL_RECORD_SIZE;
+}
+
+/**
+ * Queue the arrivals collected so far, along with the number of buses whose
+ * arrivals are now complete, to be sent to the watch
+ */
+function flushArrivalsBatch(batch) {
   var dictionary = {
-    'AppMessage_stopId': 0,
-    'AppMessage_routeId': 0,
-    'AppMessage_tripId': 0,
-    'AppMessage_arrivalDelta': 0,
-    'AppMessage_arrivalDeltaString': 0,
-    'AppMessage_itemsRemaining': 0,
-    'AppMessage_transactionId': transactionId,
-    'AppMessage_arrivalCode': 's',
-    'AppMessage_scheduled': "",
-    'AppMessage_predicted': "",
+    'AppMessage_count': batch.completed,
+    'AppMessage_sequence': batch.messages.length,
+    'AppMessage_transactionId': batch.transactionId,
+    'AppMessage_baseTransactionId': batch.base,
     'AppMessage_messageType': 0 // arrival time
   };
+  if(batch.records.length > 0) {
+    dictionary.AppMessage_arrivalList = batch.records;
+  }
+  if(batch.remaining !== null) {
+    batch.remaining -= batch.completed;
+    dictionary.AppMessage_itemsRemaining = batch.remaining;
+  }
+  if(batch.busFilter !== null) {
+    // only needs sending once
+    dictionary.AppMessage_busFilter = batch.busFilter;
+    batch.busFilter = null;
+    batch.maxSize += TUPLE_HEADER_SIZE + dictionary.AppMessage_busFilter.length;
+  }
+  batch.messages.push(dictionary);
+  batch.records = [];
+  batch.size = 0;
+  batch.completed = 0;
+  sendNextArrivalsBatch(batch);
+}
 
-  // Send to Pebble
-  sendAppMessage(dictionary,
+/**
+ * Send the batches one at a time, in order. A batch that can't be delivered
+ * is skipped; the watch notices the gap and asks for it again.
+ */
+function sendNextArrivalsBatch(batch) {
+  if(batch.sending || batch.nextMessage >= batch.messages.length) {
+    return;
+  }
+  if(batch.transactionId != currentTransaction) {
+    // the transaction has been canceled
+    return;
+  }
+
+  var sequence = batch.nextMessage;
+  var last = function() {
+    return batch.done && (sequence == batch.messages.length - 1);
+  };
+  batch.nextMessage += 1;
+  batch.sending = true;
+  sendAppMessage(batch.messages[sequence],
     function(e) {
-      // get the arrivals for the next bus in the request
-      getArrivals(busArray, transactionId);
+      batch.sending = false;
+      if(last() && batch.transactionId == currentTransaction) {
+        // the watch has all of this transaction's arrivals
+        sentArrivals = {
+          'transactionId': batch.transactionId,
+          'version': favorites.version,
+          'arrivals': batch.next
+        };
+      }
+      sendNextArrivalsBatch(batch);
+    },
+    function() {
+      batch.sending = false;
+      sendNextArrivalsBatch(batch);
     }
   );
 }
 
 /**
- * Sends bus arrival information from 'arrivals' for the 'bus' to the watch,
- * one arrival at a time. When the current arrivals have been exhausted,
- * starts the process of getting the arrivals fort he next bus in 'busArray'
+ * The watch missed arrivals batches; send them again starting from
+ * 'sequence'
  */
-function getNextArrival(bus, busArray, arrivals, currentTime, transactionId) {
-  var stopId = bus.stopId;
-  var routeId = bus.routeId;
-
-  // find the next arrival for this bus
-  var arrival = arrivals.shift();
-  while(arrival && arrival.routeId && arrival.routeId != routeId) {
-    arrival = arrivals.shift();
+function resendArrivalsBatches(transactionId, sequence) {
+  var batch = arrivalsBatch;
+  if(!batch || batch.transactionId != transactionId ||
+     transactionId != currentTransaction) {
+    return;
   }
+  console.log('resendArrivalsBatches: from ' + sequence);
+  batch.nextMessage = Math.min(batch.nextMessage, sequence);
+  sendNextArrivalsBatch(batch);
+}
+
+/**
+ * Adds the arrivals from 'arrivals', the trimmed arrivals of the 'bus'
+ * route at its stop, to the batch. Times are moved onto the phone's clock,
+ * which the watch counts down from, by adding 'clockOffset'. Only the next
+ * ARRIVALS_PER_BUS arrivals within the minutes the server was asked for
+ * are sent; the watch keeps no more.
+ */
+function addArrivalsForBus(bus, arrivals, clockOffset, batch) {
+  var now = millisToSeconds(Date.now());
+  var windowStart = now - OBA_ARRIVALS_OPTIONS.minutesBefore*60;
+  var windowEnd = now + OBA_ARRIVALS_OPTIONS.minutesAfter*60;
+  var kept = [];
+
+  for(var i = 0; i < arrivals.length; i++) {
+    var arrival = arrivals[i];
 
-  // if we found an arrival for the bus, send it along,
-  // or, the transaction has not been canceled
-  if(arrival && arrival.routeId && (arrival.routeId == routeId) &&
-     (transactionId == currentTransaction)) {
-    var arrivalDelta = 0;
-    var arrivalTime = 0;
     var scheduledArrivalTime = arrival.scheduledArrivalTime;
     var predictedArrivalTime = arrival.predictedArrivalTime;
 
     var arrivalCode = 's';
 
-    var scheduled_string = formatTimeHHMMA(new Date(scheduledArrivalTime));
-    var predicted_string = "n/a";
+    // the watch formats times itself from epoch seconds; 0 == unknown
+    var scheduled = millisToSeconds(scheduledArrivalTime + clockOffset);
+    var predicted = 0;
 
     if(predictedArrivalTime !== undefined && predictedArrivalTime !== 0) {
-      arrivalTime = predictedArrivalTime;
       var schedule_difference = predictedArrivalTime - scheduledArrivalTime;
-      predicted_string = formatTimeHHMMA(new Date(predictedArrivalTime));
+      predicted = millisToSeconds(predictedArrivalTime + clockOffset);
 
       // set arrival status
       if(schedule_difference > 60000) {
@@ -293,53 +608,67 @@ function getNextArrival(bus, busArray, arrivals, currentTime, transactionId) {
         arrivalCode = 'o';
       }
     }
-    else {
-      // arrival time is unknown
-      arrivalTime = scheduledArrivalTime;
-    }
-
-    arrivalDelta = arrivalTime - currentTime;
 
-    // data to send back to watch
-    var dictionary = {
-      'AppMessage_stopId': stopId,
-      'AppMessage_routeId': routeId,
-      'AppMessage_tripId': arrival.tripId,
-      'AppMessage_arrivalDelta': arrivalDelta,
-      'AppMessage_arrivalDeltaString':
-          millisToMinutesAndSecondsOba(arrivalDelta),
-      'AppMessage_itemsRemaining': 1,
-      'AppMessage_transactionId': transactionId,
-      'AppMessage_arrivalCode': arrivalCode,
-      'AppMessage_scheduled': scheduled_string,
-      'AppMessage_predicted': predicted_string,
-      'AppMessage_messageType': 0 // arrival time
-    };
+    var arrivalTime = predicted !== 0 ? predicted : scheduled;
+    if(arrivalTime >= windowStart && arrivalTime <= windowEnd) {
+      kept.push({
+        'time': arrivalTime,
+        'record': [arrival.tripHash, scheduled, predicted, arrivalCode]
+      });
+    }
+  }
 
-    // console.log("getNextArrival:\n  " + JSON.stringify(dictionary));
+  kept.sort(function(a, b) { return a.time - b.time; });
+  kept = kept.slice(0, ARRIVALS_PER_BUS);
 
-    // Send to Pebble
-    sendAppMessage(dictionary,
-      function(e) {
-        getNextArrival(bus, busArray, arrivals, currentTime, transactionId);
-      }
-    );
+  // the bus' arrivals that aren't kept are removed before any are added, so
+  // the watch never holds more than ARRIVALS_PER_BUS of them
+  var keep = {};
+  for(var j = 0; j < kept.length; j++) {
+    keep[kept[j].record[0]] = true;
   }
-  else {
-    completeArrivalsRequest(busArray, transactionId);
+  addRemovedArrivals(batch, function(busIndex, tripHash) {
+    return busIndex != bus.busIndex || keep.hasOwnProperty(tripHash);
+  });
+
+  for(var k = 0; k < kept.length; k++) {
+    var record = kept[k].record;
+    addArrival(batch, bus.busIndex, record[0], record[1], record[2], record[3]);
   }
 }
 
 /**
- * Parse json 'responseText' from the arrivals OBA call for 'bus' and
- * trigger the sending of the arrivals info to the watch
+ * Add the arrivals for 'bus' from the OBA arrivals response cached in
+ * 'entry' to the batch
+ */
+function processArrivalsResponse(bus, batch, entry) {
+  var arrivals = entry.routes.hasOwnProperty(bus.routeId) ?
+                 entry.routes[bus.routeId] : [];
+
+  // the server's time is compared with the phone's when it was fetched,
+  // so a response reused from the cache is still moved by the right amount
+  addArrivalsForBus(bus, arrivals, entry.fetched - entry.currentTime, batch);
+
+  // this bus is complete
+  batch.completed += 1;
+}
+
+/**
+ * Parse the json 'responseText' of the arrivals OBA call once, keeping only
+ * what's sent to the watch of each arrival, bucketed by routeId
  */
-function processArrivalsResponse(bus, busArray, transactionId, responseText) {
+function parseArrivalsResponse(responseText) {
+  var start = Date.now();
+
   // responseText contains a JSON object
   var json = JSON.parse(responseText);
+  var routes = {};
+  var currentTime = Date.now();
+
+  if(json.data && json.currentTime) {
+    currentTime = json.currentTime;
 
-  if(json.data !== null && json.currentTime !== null) {
-    var arrivalsAndDepartures;
+    var arrivalsAndDepartures = [];
     if(json.data.hasOwnProperty("entry") &&
       json.data.entry.hasOwnProperty("arrivalsAndDepartures")) {
       arrivalsAndDepartures = json.data.entry.arrivalsAndDepartures;
@@ -348,72 +677,375 @@ function processArrivalsResponse(bus, busArray, transactionId, responseText) {
       // special case for New York (MTA)
       arrivalsAndDepartures = json.data.arrivalsAndDepartures;
     }
-    var currentTime = json.currentTime;
 
     // arrivalsAndDepartures can be zero length; it does not represent
     // an unrecoverable error
-    getNextArrival(bus,
-                   busArray,
-                   arrivalsAndDepartures,
-                   currentTime,
-                   transactionId);
+    for(var i = 0; i < arrivalsAndDepartures.length; i++) {
+      var arrival = arrivalsAndDepartures[i];
+      if(!arrival.routeId) {
+        continue;
+      }
+      if(!routes.hasOwnProperty(arrival.routeId)) {
+        routes[arrival.routeId] = [];
+      }
+      routes[arrival.routeId].push({
+        'tripHash': stringHash(arrival.tripId),
+        'scheduledArrivalTime': arrival.scheduledArrivalTime,
+        'predictedArrivalTime': arrival.predictedArrivalTime
+      });
+    }
   }
-  else {
+  // else {
   //   sendError(DIALOG_INTERNET_ERROR + "\n\n0x0001");
-    completeArrivalsRequest(busArray, transactionId);
+  // }
+
+  console.log('parseArrivalsResponse: ' + responseText.length + ' bytes, ' +
+              (Date.now() - start) + ' ms');
+  return { 'currentTime': currentTime, 'routes': routes };
+}
+
+/**
+ * Start as many of the queued OBA arrivals requests as the concurrency limit
+ * allows
+ */
+function startArrivalsFetches() {
+  while(arrivalsFetchCount < ARRIVALS_FETCH_CONCURRENCY &&
+        arrivalsFetchQueue.length > 0) {
+    var fetch = arrivalsFetchQueue.shift();
+
+    // drop the fetch if only canceled transactions were waiting on it
+    var waiters = arrivalsFetches[fetch.url].filter(function(waiter) {
+      return waiter.transactionId == currentTransaction;
+    });
+    if(waiters.length === 0) {
+      delete arrivalsFetches[fetch.url];
+      continue;
+    }
+    arrivalsFetches[fetch.url] = waiters;
+    startArrivalsFetch(fetch);
+  }
+}
+
+function startArrivalsFetch(fetch) {
+  function finish(responseText) {
+    var waiters = arrivalsFetches[fetch.url];
+    delete arrivalsFetches[fetch.url];
+    arrivalsFetchCount -= 1;
+
+    // waiters are told of a failed fetch with a null entry
+    var entry = null;
+    if(responseText !== null) {
+      // a response that doesn't parse is treated as a failed fetch
+      try {
+        entry = cacheArrivals(fetch.stopId, responseText);
+      }
+      catch(e) {
+        console.log("Bad arrivals response for " + fetch.stopId + ": " + e);
+      }
+    }
+    for(var i = 0; i < waiters.length; i++) {
+      waiters[i].callback(entry);
+    }
+    startArrivalsFetches();
   }
+
+  arrivalsFetchCount += 1;
+  xhrRequest(fetch.url, 'GET',
+    function(responseText) { finish(responseText); },
+    function() { finish(null); }
+  );
 }
 
 /**
- * for each bus in the 'busArray' get the bus' arrivals at it's stop and send
- * them back to the watch - since this can result in multiple calls to get
- * arrivals and departures data for the same stop from OBA, the results
- * are cached for each transaction with the watch
+ * Cache the parsed OBA arrivals 'responseText' for 'stopId', dropping
+ * expired entries, and the oldest if there are too many. Returns the cache
+ * entry.
  */
-function getArrivals(busArray, transactionId) {
-  var bus = busArray.shift();
+function cacheArrivals(stopId, responseText) {
+  var now = Date.now();
+  var stopIds = Object.keys(arrivalsJsonCache);
+  var oldest = null;
+  for(var i = 0; i < stopIds.length; i++) {
+    var cached = arrivalsJsonCache[stopIds[i]];
+    if(now - cached.fetched > ARRIVALS_CACHE_TTL) {
+      delete arrivalsJsonCache[stopIds[i]];
+    }
+    else if(!oldest || cached.fetched < arrivalsJsonCache[oldest].fetched) {
+      oldest = stopIds[i];
+    }
+  }
+  if(oldest && Object.keys(arrivalsJsonCache).length >=
+     ARRIVALS_CACHE_MAX_ENTRIES) {
+    delete arrivalsJsonCache[oldest];
+  }
+
+  var parsed = parseArrivalsResponse(responseText);
+  var entry = {
+    'fetched': now,
+    'currentTime': parsed.currentTime, // server's time when fetched
+    'routes': parsed.routes
+  };
+  arrivalsJsonCache[stopId] = entry;
+  return entry;
+}
+
+/**
+ * Get the OBA arrivals for 'stopId' for transaction 'transactionId',
+ * calling 'callback' with the cache entry of the response, or null if it
+ * couldn't be fetched. Requests run in parallel up to
+ * ARRIVALS_FETCH_CONCURRENCY, and a stop that's already being fetched isn't
+ * fetched twice.
+ */
+function fetchArrivalsForStop(stopId, transactionId, callback) {
+  var cached = arrivalsJsonCache[stopId];
+  if(cached && (Date.now() - cached.fetched <= ARRIVALS_CACHE_TTL)) {
+    callback(cached);
+    return;
+  }
 
-  if(bus) {
-    var stopId = bus.stopId;
+  var url = OBA_SERVER + '/api/where/arrivals-and-departures-for-stop/' +
+    stopId + '.json?key=' + OBA_API_KEY + OBA_ARRIVALS_QUERY;
 
-    if(arrivalsJsonCache[stopId]) {
-      processArrivalsResponse(bus, busArray, transactionId, arrivalsJsonCache[stopId]);
+  var waiter = { 'transactionId': transactionId, 'callback': callback };
+  if(arrivalsFetches[url]) {
+    arrivalsFetches[url].push(waiter);
+    return;
+  }
+  arrivalsFetches[url] = [waiter];
+  arrivalsFetchQueue.push({ 'url': url, 'stopId': stopId });
+  startArrivalsFetches();
+}
+
+/**
+ * Add the arrivals of the buses whose stops have been fetched to the batch,
+ * in the order of the buses, stopping at the first bus still waiting on its
+ * stop; the transaction is complete once every bus has been added
+ */
+function streamArrivals(batch) {
+  if(batch.transactionId != currentTransaction || batch.done) {
+    // the transaction has been canceled, or is complete
+    return;
+  }
+
+  while(batch.nextBus < batch.buses.length) {
+    var bus = batch.buses[batch.nextBus];
+    if(!batch.responses.hasOwnProperty(bus.stopId)) {
+      return;
+    }
+    var entry = batch.responses[bus.stopId];
+    if(entry !== null) {
+      processArrivalsResponse(bus, batch, entry);
     }
     else {
-      var url = OBA_SERVER + '/api/where/arrivals-and-departures-for-stop/' +
-        stopId + '.json?key=' + OBA_API_KEY;
-
-      // Send request to OneBusAway
-      xhrRequest(url, 'GET',
-        function(responseText) {
-          arrivalsJsonCache[stopId] = responseText;
-          processArrivalsResponse(bus, busArray, transactionId, responseText);
-        }
-      );
+      // the stop couldn't be fetched; complete the bus without new arrivals
+      keepPreviousArrivals(bus, batch);
+      batch.completed += 1;
     }
+    batch.nextBus += 1;
   }
+
+  // send whatever is left, completing the transaction
+  batch.done = true;
+  flushArrivalsBatch(batch);
+}
+
+/**
+ * for each bus in the 'busArray' get the bus' arrivals at it's stop and send
+ * them back to the watch in batches - every stop is fetched at once, and
+ * the arrivals are sent in the order of the buses as their stops come in
+ */
+function getArrivals(busArray, batch) {
+  if(batch.transactionId != currentTransaction) {
+    // the transaction has been canceled
+    return;
+  }
+  if(OBA_SERVER === '') {
+    // no location has picked a server to ask
+    console.log("getArrivals: no OBA server");
+    sendError(DIALOG_GPS_ERROR + "\n\n0x0004");
+    return;
+  }
+
+  batch.buses = busArray;
+
+  // make room on the watch before any arrivals are added
+  addRemovedBuses(batch);
+
+  for(var i = 0; i < busArray.length; i++) {
+    getArrivalsForStop(busArray[i].stopId, batch);
+  }
+  streamArrivals(batch);
+}
+
+function getArrivalsForStop(stopId, batch) {
+  fetchArrivalsForStop(stopId, batch.transactionId, function(entry) {
+    batch.responses[stopId] = entry;
+    streamArrivals(batch);
+  });
 }
 
 
 /**
- * build an array of route & stop pairs representing a bus from the
+ * build an array of the buses on the watch, in index order, from the 
  * delimited list sent from the watch
  */
 function parseBusList(busList) {
-  // parse out the bus list (| separate "stopId,routeId" pairs)
+  // parse out the bus list (| separate "stopId,routeId,lat,lon", with lat
+  // and lon in microdegrees)
   var busPairs = busList.split("|");
   var busArray = [];
   for(var i = 0; i < busPairs.length; i++) {
     var pair = busPairs[i].split(",");
-    var bus = {
-      "stopId":pair[0],
-      "routeId":pair[1]
+    if(pair.length == 4) {
+      busArray.push({
+        "stopId":pair[0],
+        "routeId":pair[1],
+        "lat":parseInt(pair[2], 10) / 1000000,
+        "lon":parseInt(pair[3], 10) / 1000000
+      });
+    }
+  }
+  return busArray;
+}
+
+/** load the copy of the watch's buses from local storage */
+function loadFavorites() {
+  try {
+    favorites = JSON.parse(localStorage.getItem(FAVORITES_STORAGE_KEY));
+  }
+  catch(e) {
+    favorites = null;
+  }
+}
+
+/** save a copy of the watch's buses, identified by the watch's 'version' */
+function saveFavorites(version, busArray) {
+  favorites = {
+    "version": version,
+    "buses": busArray
+  };
+  localStorage.setItem(FAVORITES_STORAGE_KEY, JSON.stringify(favorites));
+}
+
+/**
+ * add the part of the watch's buses starting at 'index' to the copy being
+ * received for 'transactionId'; saves the copy and returns true once all
+ * 'count' buses are in, otherwise the watch is to be asked for the part
+ * starting at pendingFavorites.buses.length
+ */
+function receiveFavorites(transactionId, version, index, count, busList) {
+  if(!pendingFavorites ||
+     pendingFavorites.transactionId != transactionId ||
+     pendingFavorites.version !== version) {
+    pendingFavorites = {
+      "transactionId": transactionId,
+      "version": version,
+      "buses": []
     };
-    busArray.push(bus);
+  }
+  // a part out of order is asked for again
+  if(index == pendingFavorites.buses.length) {
+    pendingFavorites.buses =
+        pendingFavorites.buses.concat(parseBusList(busList));
+  }
+  if(pendingFavorites.buses.length < count) {
+    return false;
+  }
+
+  saveFavorites(version, pendingFavorites.buses);
+  pendingFavorites = null;
+  return true;
+}
+
+/**
+ * build the array of nearby buses to get arrivals for from the bitmap of
+ * bus indices sent from the watch
+ */
+function nearbyFavorites(busFilter) {
+  var busArray = [];
+  if(!busFilter) {
+    return busArray;
+  }
+
+  for(var i = 0; i < favorites.buses.length; i++) {
+    if(busFilter[i >> 3] & (1 << (i & 7))) {
+      busArray.push({
+        "stopId":favorites.buses[i].stopId,
+        "routeId":favorites.buses[i].routeId,
+        "busIndex":i
+      });
+    }
   }
   return busArray;
 }
 
+/**
+ * gets the current location; uses the location being watched if there is
+ * one. The OBA server is picked from the location, as watchLocationSuccess()
+ * does.
+ */
+function withCurrentLocation(callback) {
+  if(lastSentLocation !== null) {
+    callback(lastSentLocation);
+    return;
+  }
+
+  navigator.geolocation.getCurrentPosition(
+      function(pos) {
+        var coords = positionCoords(pos);
+        setObaServerByLocation(coords.lat, coords.lon);
+        callback(coords);
+      },
+      function(e) {
+        console.log("Error requesting location!");
+        sendError(DIALOG_GPS_ERROR + "\n\n0x0003");
+      },
+      {timeout: GPS_TIMEOUT, maximumAge: GPS_MAX_AGE}
+  );
+}
+
+/**
+ * filter the copy of the watch's buses to those within 'radius' meters of
+ * the current location; calls back with the nearby buses, and a bitmap of
+ * their indices for the watch
+ */
+function filterFavoritesByLocation(radius, callback) {
+  withCurrentLocation(function(coords) {
+    var busArray = [];
+    var busFilter = [];
+    for(var i = 0; i < favorites.buses.length; i++) {
+      if((i & 7) === 0) {
+        busFilter.push(0);
+      }
+      var bus = favorites.buses[i];
+      if(DistanceBetween(coords.lat, coords.lon, bus.lat, bus.lon) <= 
+         radius / 1000) {
+        busFilter[i >> 3] |= (1 << (i & 7));
+        busArray.push({
+          "stopId":bus.stopId,
+          "routeId":bus.routeId,
+          "busIndex":i
+        });
+      }
+    }
+    callback(busArray, busFilter);
+  });
+}
+
+/**
+ * ask the watch to send the list of buses from 'index' on, as the copy on
+ * the phone is out of date
+ */
+function requestFavorites(transactionId, index) {
+  var dictionary = {
+    'AppMessage_transactionId': transactionId,
+    'AppMessage_index': index,
+    'AppMessage_messageType': 6 // buses sync
+  };
+
+  sendAppMessage(dictionary, function() { });
+}
+
 /**
  * send a message signifying the end of get routes transaction
  */
@@ -797,29 +1429,72 @@ function getRoutesForStop(stopId, transactionId) {
 }
 
 /**
- * gets the current GPS location, sends lat/long to the watch
+ * returns the (lat, lon) of 'pos', substituting the test location if set
+ */
+function positionCoords(pos) {
+  var lat = pos.coords.latitude;
+  var lon = pos.coords.longitude;
+
+  // test code
+  if(typeof test_lat !== 'undefined' && typeof test_lon !== 'undefined') {
+    lat = test_lat;
+    lon = test_lon;
+  }
+
+  return {'lat': lat, 'lon': lon};
+}
+
+/**
+ * handles a position update from the location watch; the location is only
+ * sent to the watch if it asked for it, or the phone has moved far enough
+ * from the last location sent
+ */
+function watchLocationSuccess(pos) {
+  var coords = positionCoords(pos);
+
+  var moved = (lastSentLocation === null) ||
+      (DistanceBetween(lastSentLocation.lat,
+                       lastSentLocation.lon,
+                       coords.lat,
+                       coords.lon) > LOCATION_PUSH_DISTANCE);
+
+  if(locationRequested || moved) {
+    locationRequested = false;
+    lastSentLocation = coords;
+    setObaServerByLocation(coords.lat, coords.lon);
+    getLocationSuccess(0, pos);
+  }
+}
+
+/**
+ * sends the current GPS location to the watch, and keeps watching the 
+ * location so that updates are pushed to the watch as the phone moves
  */
 function getLocation() {
-  navigator.geolocation.getCurrentPosition(
-      function(pos) {
-        var lat = pos.coords.latitude;
-        var lon = pos.coords.longitude;
+  locationRequested = true;
 
-        // test code
-        if(typeof test_lat !== 'undefined' && typeof test_lon !== 'undefined') {
-          lat = test_lat;
-          lon = test_lon;
-        }
+  if(locationWatchId !== null && lastSentLocation !== null) {
+    // already tracking; answer right away with the latest location
+    locationRequested = false;
+    getLocationSuccess(0, {'coords': {'latitude': lastSentLocation.lat,
+                                      'longitude': lastSentLocation.lon}});
+    return;
+  }
 
-        setObaServerByLocation(lat, lon);
-        getLocationSuccess(0, pos);
-      },
-      function(e) {
-        console.log("Error requesting location!");
-        sendError(DIALOG_GPS_ERROR + "\n\n0x0002");
-      },
-      {timeout: GPS_TIMEOUT, maximumAge: GPS_MAX_AGE}
-  );
+  if(locationWatchId === null) {
+    locationWatchId = navigator.geolocation.watchPosition(
+        watchLocationSuccess,
+        function(e) {
+          console.log("Error requesting location!");
+          // only bother the user if the watch is waiting on a location
+          if(locationRequested) {
+            locationRequested = false;
+            sendError(DIALOG_GPS_ERROR + "\n\n0x0002");
+          }
+        },
+        {timeout: GPS_TIMEOUT, maximumAge: GPS_MAX_AGE}
+    );
+  }
 }
 
 /**
@@ -847,6 +1522,9 @@ Pebble.addEventListener('ready',
   function(e) {
     console.log('PebbleKit JS ready!');
 
+    loadFavorites();
+    loadObaServer();
+
     // send the current location to the watch
     getLocation();
   }
@@ -863,11 +1541,43 @@ Pebble.addEventListener('appmessage',
     switch(e.payload.AppMessage_messageType) {
       case 0: // get arrival times
         currentTransaction = e.payload.AppMessage_transactionId;
-        var busList = parseBusList(e.payload.AppMessage_busList);
-        // var halfLength = Math.ceil(busList.length / 2);
-        // var leftSide = busList.splice(0,halfLength);
-        arrivalsJsonCache = {};
-        getArrivals(busList, e.payload.AppMessage_transactionId);
+        var version = e.payload.AppMessage_busesVersion;
+        if(e.payload.AppMessage_busList !== undefined &&
+           !receiveFavorites(currentTransaction,
+                             version,
+                             e.payload.AppMessage_index,
+                             e.payload.AppMessage_count,
+                             e.payload.AppMessage_busList)) {
+          // the watch sent part of its buses; ask for the next part
+          requestFavorites(currentTransaction,
+                           pendingFavorites.buses.length);
+          break;
+        }
+        if(!favorites || favorites.version !== version) {
+          requestFavorites(currentTransaction, 0);
+          break;
+        }
+        var batch = createArrivalsBatch(e.payload.AppMessage_transactionId,
+                                        e.payload.AppMessage_inboxSize,
+                                        e.payload.AppMessage_baseTransactionId);
+        arrivalsBatch = batch;
+        if(e.payload.AppMessage_radius !== undefined) {
+          // the watch wants the buses filtered here
+          filterFavoritesByLocation(e.payload.AppMessage_radius,
+            function(busList, busFilter) {
+              batch.remaining = busList.length;
+              batch.busFilter = busFilter;
+              batch.maxSize -= ARRIVAL_FILTER_OVERHEAD + busFilter.length;
+              getArrivals(busList, batch);
+            }
+          );
+        }
+        else {
+          var busFilter = e.payload.AppMessage_busFilter;
+          withObaServer(function() {
+            getArrivals(nearbyFavorites(busFilter), batch);
+          });
+        }
         // getArrivals(leftSide, e.payload.AppMessage_transactionId);
         break;
       case 1: // get nearyby stops
@@ -892,6 +1602,10 @@ Pebble.addEventListener('appmessage',
         currentTransaction = e.payload.AppMessage_transactionId;
         getRoutesForStop(stopId, e.payload.AppMessage_transactionId);
         break;
+      case 7: // resend arrivals
+        resendArrivalsBatches(e.payload.AppMessage_transactionId,
+                              e.payload.AppMessage_sequence);
+        break;
       default:
         console.log('unknown messageType:' + e.payload.AppMessage_messageType);
         break;
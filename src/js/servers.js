@@ -1,5 +1,8 @@
 var servers = {
   // 'url':{'key':ABCD, 'lat':123, 'lon':-123}
+  // optionally overriding how much the arrivals requests ask for, e.g.
+  //   'arrivals':{'minutesBefore':2, 'minutesAfter':35,
+  //               'includeReferences':true}
   // Puget Sound
   'http://api.pugetsound.onebusaway.org': {
     'key':'###YOUR KEY HERE###',
@@ -22,7 +25,9 @@ var servers = {
   'http://bustime.mta.info': {
     'key':'###YOUR KEY HERE###',
     'lat':40.707678,
-    'lon':-74.017681
+    'lon':-74.017681,
+    // not a stock OBA server; leave its responses as they are
+    'arrivals':{'includeReferences':true}
   },
   // Rogue Valley, OR
   'http://oba.rvtd.org:8080/onebusaway-api-webapp': {
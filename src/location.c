@@ -95,4 +95,78 @@ sll DistanceBetweenSLL(sll lat1, sll lon1, sll lat2, sll lon2) {
   sll result = sllmul2(sllatan2(d_sqrt, d_sqrt_1));
 
   return sllmul(R,result);
-}
\ No newline at end of file
+}
+
+// convert from 32.32 fixed point degrees
+int32_t SllToMicrodegrees(const sll degrees) {
+  return (int32_t)((degrees * 1000000) >> 32);
+}
+
+#ifdef DISTANCE_HAVERSINE
+
+void DistanceQueryInit(DistanceQuery* query, 
+                       const sll lat, 
+                       const sll lon, 
+                       const uint32_t radius_m) {
+  query->lat = lat;
+  query->lon = lon;
+  query->radius_km = slldiv(int2sll(radius_m), int2sll(1000));
+}
+
+bool DistanceQueryContains(const DistanceQuery* query, 
+                           const sll lat, 
+                           const sll lon) {
+  return DistanceBetweenSLL(lat, lon, query->lat, query->lon) <= 
+      query->radius_km;
+}
+
+#else
+
+// Equirectangular approximation, compared as squared distances in integer
+// microdegrees; no trig, division or square root per point. Over the 
+// 100-2500 M radii the settings allow, the error vs. a double precision
+// haversine is well under a meter (unlike DistanceBetweenSLL above):
+//
+// (47.6816800, -122.3098810) to:          haversine   equirectangular
+// (48.6816800, -121.3098810)              133643.3 M  134046.9 M
+// (47.6843, -122.3088840000)                 300.7 M     300.8 M
+// (47.684112999, -122.3088840000)            280.6 M     280.6 M
+// (47.6826800, -122.3088840000)              133.9 M     134.0 M
+// (47.6816800, -122.3088840000)               74.6 M      74.6 M
+// 100 M to the north east                    100.00 M    100.01 M
+// 2500 M to the north east                  2499.81 M   2500.01 M
+
+// microdegrees of latitude per 100 km (R = 6371 km)
+#define MICRODEGREES_PER_100KM 899322
+
+void DistanceQueryInit(DistanceQuery* query, 
+                       const sll lat, 
+                       const sll lon, 
+                       const uint32_t radius_m) {
+  query->lat = SllToMicrodegrees(lat);
+  query->lon = SllToMicrodegrees(lon);
+  query->cos_lat = (int32_t)(sllcos(slldeg2rad(lat)) >> 16);
+  int64_t radius = ((int64_t)radius_m * MICRODEGREES_PER_100KM) / 100000;
+  query->radius_sq = radius * radius;
+}
+
+bool DistanceQueryContains(const DistanceQuery* query, 
+                           const sll lat, 
+                           const sll lon) {
+  int32_t dlat = SllToMicrodegrees(lat) - query->lat;
+  int32_t dlon = SllToMicrodegrees(lon) - query->lon;
+
+  // take the short way around at the antimeridian
+  if(dlon > 180000000) {
+    dlon -= 360000000;
+  }
+  else if(dlon < -180000000) {
+    dlon += 360000000;
+  }
+
+  int64_t dy = dlat;
+  int64_t dx = ((int64_t)dlon * query->cos_lat) >> 16;
+  return (dx*dx + dy*dy) <= query->radius_sq;
+}
+
+#endif // DISTANCE_HAVERSINE
\ No newline at end of file
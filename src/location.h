@@ -4,6 +4,30 @@
 #include <pebble.h>
 #include <pebble-math-sll/math-sll.h>
 
+// A radius search around a fixed point. Everything that depends only on the
+// query (the radius and cos(lat)) is computed once by DistanceQueryInit so 
+// that testing each candidate point is cheap.
+typedef struct {
+#ifdef DISTANCE_HAVERSINE
+  sll lat;
+  sll lon;
+  sll radius_km;
+#else
+  int32_t lat;        // microdegrees
+  int32_t lon;        // microdegrees
+  int32_t cos_lat;    // cos(lat), 16.16 fixed point
+  int64_t radius_sq;  // squared radius, in microdegrees of latitude
+#endif
+} DistanceQuery;
+
+int32_t SllToMicrodegrees(const sll degrees);
 sll DistanceBetweenSLL(sll lat1, sll lon1, sll lat2, sll lon2);
+void DistanceQueryInit(DistanceQuery* query, 
+                       const sll lat, 
+                       const sll lon, 
+                       const uint32_t radius_m);
+bool DistanceQueryContains(const DistanceQuery* query, 
+                           const sll lat, 
+                           const sll lon);
 
 #endif //LOCATION_H
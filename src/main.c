@@ -27,6 +27,11 @@ static void HandleInit(AppData* appdata) {
   ArrivalsConstructor(&appdata->next_arrivals);
   LoadBusesFromPersistence(&appdata->buses);
 
+  // show the last arrivals until the live ones come in
+  appdata->arrivals_time = 0;
+  appdata->arrivals_stale = 
+      PersistReadArrivals(&appdata->buses, appdata->arrivals);
+
   // Initialize app message communication
   CommunicationInit(appdata);
 
@@ -43,6 +48,15 @@ static void HandleInit(AppData* appdata) {
 }
 
 static void HandleDeinit(AppData* appdata) {
+  // snapshot the live arrivals for the next launch
+  if(!appdata->arrivals_stale && 
+     !appdata->refresh_arrivals && 
+     appdata->arrivals_time != 0) {
+    PersistWriteArrivals(&appdata->buses, 
+                         appdata->arrivals, 
+                         appdata->arrivals_time);
+  }
+
   BusesDestructor(&appdata->buses);
   ArrivalsDestructor(appdata->arrivals);
   FreeAndClearPointer((void**)&appdata->arrivals);
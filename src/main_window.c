@@ -12,7 +12,17 @@
 static Window *s_main_window;
 static MenuLayer *s_menu_layer;
 static bool s_loading;
-static char* s_last_selected_trip_id;
+static uint32_t s_last_selected_trip_id;
+static AppTimer* s_countdown_timer;
+static bool s_countdown_seconds;
+
+static void ScheduleCountdown(AppData* appdata);
+
+// While loading, arrivals from the snapshot are shown if there are any
+static bool ShowLoading(const AppData* appdata) {
+  return s_loading && 
+         !(appdata->arrivals_stale && (appdata->arrivals->count > 0));
+}
 
 void MainWindowMarkForRefresh(AppData* appdata) {
   appdata->refresh_arrivals = true;
@@ -22,6 +32,7 @@ void MainWindowMarkForRefresh(AppData* appdata) {
   StopArrivalsUpdateTimer();
 
   // save some memory since we have to refresh the data 
+  appdata->arrivals_stale = false;
   ArrivalsDestructor(appdata->arrivals);
   ArrivalsDestructor(appdata->next_arrivals);
 
@@ -68,12 +79,12 @@ void MainWindowUpdateArrivals(AppData* appdata) {
   if(m.section == 0) {
     if(m.row < appdata->arrivals->count) {
       Arrival* arrival = MemListGet(appdata->arrivals, m.row);
-      char* trip_id = arrival->trip_id;
+      uint32_t trip_id = arrival->trip_id;
 
       MenuIndex set = MenuIndex(0,0);
       for(uint i = 0; i < appdata->next_arrivals->count; i++) {
         Arrival* new_arrival = MemListGet(appdata->next_arrivals, i);
-        if(strcmp(new_arrival->trip_id, trip_id) == 0) {
+        if(new_arrival->trip_id == trip_id) {
           set.row = i;
           break;
         }
@@ -83,11 +94,16 @@ void MainWindowUpdateArrivals(AppData* appdata) {
     }
   }
 
+  // the transaction is complete; give back any unused growth space
+  MemListShrinkToFit(appdata->next_arrivals);
+
   // move the temp arrivals to the display arrivals
   ArrivalsDestructor(appdata->arrivals);
   FreeAndClearPointer((void**)&appdata->arrivals);
   appdata->arrivals = appdata->next_arrivals;
   ArrivalsConstructor(&appdata->next_arrivals);
+  appdata->arrivals_stale = false;
+  appdata->arrivals_time = time(NULL);
 
   // update the the bus detals window, if it's being shown
   BusDetailsWindowUpdate(appdata);
@@ -95,6 +111,57 @@ void MainWindowUpdateArrivals(AppData* appdata) {
   // show the data, all arrivals are in
   DoneLoading(appdata);
   UpdateLoadingFlag(appdata);
+
+  // the next minute to count down to depends on the arrivals
+  ScheduleCountdown(appdata);
+}
+
+// Count the arrivals down on the watch between refreshes, redrawing only
+// when the minutes shown change
+static void Countdown(AppData* appdata) {
+  time_t now = time(NULL);
+
+  if(ArrivalsUpdateDeltas(appdata->arrivals, now) && !ShowLoading(appdata)) {
+    layer_mark_dirty(menu_layer_get_layer(s_menu_layer));
+  }
+  BusDetailsWindowTick(now);
+}
+
+static void CountdownTickHandler(struct tm *tick_time, TimeUnits units_changed) {
+  Countdown(window_get_user_data(s_main_window));
+}
+
+static void CountdownTimerCallback(void* context);
+
+// Unless ticking every second, count down when the minutes shown for an 
+// arrival next change; each arrival's minutes turn over at its own second,
+// not the clock's
+static void ScheduleCountdown(AppData* appdata) {
+  if(s_countdown_timer) {
+    app_timer_cancel(s_countdown_timer);
+    s_countdown_timer = NULL;
+  }
+  if(s_countdown_seconds || (s_main_window == NULL)) {
+    return;
+  }
+
+  time_t now;
+  uint16_t ms;
+  time_ms(&now, &ms);
+  uint32_t seconds = ArrivalsNextChange(appdata->arrivals, now);
+  if(seconds == 0) {
+    // nothing to count down
+    return;
+  }
+  s_countdown_timer = app_timer_register(seconds * 1000 - ms, 
+                                         CountdownTimerCallback, 
+                                         appdata);
+}
+
+static void CountdownTimerCallback(void* context) {
+  s_countdown_timer = NULL;
+  Countdown(context);
+  ScheduleCountdown(context);
 }
 
 static uint16_t MenuGetNumSectionsCallback(MenuLayer *menu_layer,
@@ -110,7 +177,7 @@ static uint16_t GetNumRowsCallback(MenuLayer *menu_layer,
   switch (section_index) {
     // bus list
     case 0:
-      return (!s_loading && appdata->arrivals->count > 0) ? 
+      return (!ShowLoading(appdata) && appdata->arrivals->count > 0) ? 
               appdata->arrivals->count : 1;
       break;
     // settings
@@ -134,12 +201,17 @@ static void MenuDrawHeaderCallback(GContext* ctx,
                                    uint16_t section_index,
                                    void *data) {
 
+  AppData* appdata = data;
+
   // Determine which section we're working with
   switch (section_index) {
     case 0:
       // Draw title text in the section header
       //menu_cell_basic_header_draw(ctx, cell_layer, "Routes nearby");
-      MenuCellDrawHeader(ctx, cell_layer, "Favorites nearby");
+      MenuCellDrawHeader(ctx, 
+                         cell_layer, 
+                         appdata->arrivals_stale ? 
+                            "Favorites (updating...)" : "Favorites nearby");
       break;
     case 1:
       //menu_cell_basic_header_draw(ctx, cell_layer, "Settings");
@@ -251,7 +323,7 @@ static void DrawRowCallback(GContext *ctx,
     // nearby buses menu
     case 0:
       // loading buses at launch
-      if(s_loading) {
+      if(ShowLoading(appdata)) {
         menu_cell_basic_draw(ctx,
                              cell_layer, 
                              "Loading...", 
@@ -293,11 +365,8 @@ static void DrawRowCallback(GContext *ctx,
             // TODO: does this need size checking?
             uint i = a->bus_index;
 
-            // TODO: data out of the appdata->arrivals, because directly
-            // referencing it was causing memory referencing issues -
-            // could be a bug in appdata->arrivals handling/freeing
-            char delta[10];
-            snprintf(delta, sizeof(delta), "%s", a->delta_string);
+            char delta[ARRIVAL_DELTA_STRING_SIZE];
+            ArrivalDeltaString(*a, delta, sizeof(delta));
               
             // truncate in place
             char* insert = strstr(delta, ":");
@@ -305,12 +374,12 @@ static void DrawRowCallback(GContext *ctx,
               *insert = '\0'; 
             }
 
-            char time[10];
+            char time[ARRIVAL_TIME_STRING_SIZE];
             if(a->arrival_code == 's') {
-              snprintf(time, sizeof(time), "%s", a->scheduled_arrival);
+              ArrivalScheduled(*a, time, sizeof(time));
             }
             else {
-              snprintf(time, sizeof(time), "%s", a->predicted_arrival);
+              ArrivalPredicted(*a, time, sizeof(time));
             }
             
             // TODO: arbitrary constant - consider removing 
@@ -334,7 +403,8 @@ static void DrawRowCallback(GContext *ctx,
                          appdata->buses.data[i].route_name,
                          delta,
                          time, 
-                         ArrivalColor(*a), 
+                         appdata->arrivals_stale ? 
+                            ArrivalStaleColor() : ArrivalColor(*a), 
                          stopInfo);
           }
         }
@@ -396,7 +466,7 @@ static void SelectCallback(
     // nearby buses menu
     case 0:
       // While loading at first launch, don't allow interaction on the routes
-      if(!s_loading) {
+      if(!ShowLoading(appdata)) {
         if(cell_index->row <= appdata->arrivals->count) {
           // special case: no nearby buses to show
           if(appdata->arrivals->count == 0) {
@@ -407,10 +477,7 @@ static void SelectCallback(
                 cell_index->row);
             // record the trip_id of the bus selected, to put the menu
             // cursor back in the right place when returning to this window
-            FreeAndClearPointer((void**)&s_last_selected_trip_id);
-            char* trip_id = arrival->trip_id;
-            s_last_selected_trip_id = (char*)malloc(strlen(trip_id)+1);
-            StringCopy(s_last_selected_trip_id, trip_id, strlen(trip_id)+1);
+            s_last_selected_trip_id = arrival->trip_id;
 
             // show the detail window for the bus selected
             BusDetailsWindowPush(appdata->buses.data[arrival->bus_index], 
@@ -504,11 +571,35 @@ static void WindowLoad(Window *window) {
   menu_layer_set_click_config_onto_window(s_menu_layer, window);
 
   layer_add_child(window_layer, menu_layer_get_layer(s_menu_layer));
+
+  // the menu only shows whole minutes
+  MainWindowCountdownSeconds(false);
+}
+
+// Count the arrivals down every second while seconds are being shown, and
+// as each arrival's minutes change otherwise
+void MainWindowCountdownSeconds(bool seconds) {
+  if(s_main_window == NULL) {
+    return;
+  }
+  s_countdown_seconds = seconds;
+  if(seconds) {
+    tick_timer_service_subscribe(SECOND_UNIT, CountdownTickHandler);
+  }
+  else {
+    tick_timer_service_unsubscribe();
+  }
+  ScheduleCountdown(window_get_user_data(s_main_window));
 }
 
 static void WindowUnload(Window *window) {
+  tick_timer_service_unsubscribe();
+  if(s_countdown_timer) {
+    app_timer_cancel(s_countdown_timer);
+    s_countdown_timer = NULL;
+  }
   menu_layer_destroy(s_menu_layer);
-  FreeAndClearPointer((void**)&s_last_selected_trip_id);
+  s_last_selected_trip_id = 0;
   window_destroy(s_main_window);
   s_main_window = NULL;
 }
@@ -535,10 +626,10 @@ static void WindowAppear(Window *window) {
     // try to keep the same arrival selected when returning from
     // another window
     MenuIndex m = MenuIndex(0,0);
-    if(s_last_selected_trip_id != NULL) {
+    if(s_last_selected_trip_id != 0) {
       for(uint i = 0; i < appdata->arrivals->count; i++) {
         Arrival* arrival = (Arrival*)MemListGet(appdata->arrivals, i);
-        if(strcmp(arrival->trip_id, s_last_selected_trip_id) == 0) {
+        if(arrival->trip_id == s_last_selected_trip_id) {
           m.row = i;
           break;
         }
@@ -561,7 +652,7 @@ void MainWindowInit(AppData* appdata) {
   // set the loading flag at first launch
   s_loading = true;
 
-  s_last_selected_trip_id = NULL;
+  s_last_selected_trip_id = 0;
 
   window_set_user_data(s_main_window, appdata);
 
@@ -11,5 +11,6 @@
 void MainWindowInit(AppData* appdata);
 void MainWindowUpdateArrivals(AppData* appdata);
 void MainWindowMarkForRefresh(AppData* appdata);
+void MainWindowCountdownSeconds(bool seconds);
 
 #endif //MAIN_WINDOW_H
\ No newline at end of file
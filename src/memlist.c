@@ -1,10 +1,14 @@
 #include "memlist.h"
 
+// smallest buffer allocated once a list starts to grow
+#define MEMLIST_MIN_CAPACITY 4
+
 MemList* MemListCreate(uint16_t size) {
   MemList* mem_list = malloc(sizeof(MemList));
   mem_list->data = NULL;
   mem_list->object_size = size;
   mem_list->count = 0;
+  mem_list->capacity = 0;
   return mem_list;
 }
 
@@ -12,6 +16,7 @@ void MemListClear(MemList* list) {
   free(list->data);
   list->data = NULL;
   list->count = 0;
+  list->capacity = 0;
 }
 
 uint16_t MemListCount(const MemList* list) {
@@ -28,22 +33,70 @@ void* MemListGet(const MemList* list, uint16_t pos) {
   return list->data+((list->object_size)*pos);
 }
 
-bool MemListAppend(MemList* list, void* object) {
-  void* temp_data = malloc(list->object_size*(list->count+1));
+// Resize the backing buffer to hold exactly 'capacity' objects. Never
+// shrinks below the current count.
+static bool MemListResize(MemList* list, uint16_t capacity) {
+  if(capacity < list->count) {
+    capacity = list->count;
+  }
+  if(capacity == list->capacity) {
+    return true;
+  }
+  if(capacity == 0) {
+    MemListClear(list);
+    return true;
+  }
+
+  void* temp_data = realloc(list->data, list->object_size*capacity);
   if(temp_data == NULL) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "null - size:%u count:%u", 
-        (uint)list->object_size, (uint)list->count);
+    APP_LOG(APP_LOG_LEVEL_ERROR, "null - size:%u count:%u capacity:%u", 
+        (uint)list->object_size, (uint)list->count, (uint)capacity);
+    return false;
+  }
+
+  list->data = temp_data;
+  list->capacity = capacity;
+  return true;
+}
+
+// Make room for one more object, growing the buffer by half again
+// its size so that a run of appends costs O(log n) allocations
+static bool MemListGrow(MemList* list) {
+  if(list->count < list->capacity) {
+    return true;
+  }
+  if(list->capacity == UINT16_MAX) {
+    return false;
+  }
+
+  uint32_t capacity = list->capacity + (list->capacity >> 1);
+  if(capacity < MEMLIST_MIN_CAPACITY) {
+    capacity = MEMLIST_MIN_CAPACITY;
+  }
+  if(capacity > UINT16_MAX) {
+    capacity = UINT16_MAX;
+  }
+  return MemListResize(list, capacity);
+}
+
+bool MemListReserve(MemList* list, uint16_t capacity) {
+  if(capacity <= list->capacity) {
+    return true;
+  }
+  return MemListResize(list, capacity);
+}
+
+bool MemListShrinkToFit(MemList* list) {
+  return MemListResize(list, list->count);
+}
+
+bool MemListAppend(MemList* list, void* object) {
+  if(!MemListGrow(list)) {
     return false;
   }
   
-  // copy beginning of list
-  memcpy(temp_data, list->data, (list->object_size)*(list->count));
- 
   // insert
-  memcpy(temp_data+(list->object_size*list->count), object, list->object_size);
-  
-  free(list->data);
-  list->data = temp_data;
+  memcpy(list->data+(list->object_size*list->count), object, list->object_size);
   list->count += 1;
   
   return true;
@@ -54,26 +107,17 @@ bool MemListInsertAfter(MemList* list, void* object, uint16_t pos) {
     return false;
   }
   
-  void* temp_data = malloc(list->object_size*(list->count+1));
-  if(temp_data == NULL) {
-    APP_LOG(APP_LOG_LEVEL_ERROR, "null - size:%u count:%u", 
-        (uint)list->object_size, (uint)list->count);
+  if(!MemListGrow(list)) {
     return false;
   }
   
-  // copy beginning of list
-  memcpy(temp_data, list->data, (list->object_size)*pos);
+  // shift end of list
+  memmove(list->data+(list->object_size)*(pos+1), 
+          list->data+(list->object_size)*(pos), 
+          list->object_size*(list->count-pos));
  
   // insert
-  memcpy(temp_data+(list->object_size)*pos, object, list->object_size);
-  
-  // copy end of list
-  memcpy(temp_data+(list->object_size)*(pos+1), 
-         list->data+(list->object_size)*(pos), 
-         list->object_size*(list->count-pos));
-
-  free(list->data);
-  list->data = temp_data;
+  memcpy(list->data+(list->object_size)*pos, object, list->object_size);
   list->count += 1;
   
   return true;
@@ -87,10 +131,15 @@ MemList* MemListCopy(const MemList* list) {
     return NULL;
   }
   memcpy(ret_list, list, sizeof(MemList));
-  uint16_t size = list->object_size*(list->count);
-  void* temp_data = malloc(size);
-  memcpy(temp_data, list->data, size);
-  ret_list->data = temp_data;
+  ret_list->data = NULL;
+  ret_list->capacity = 0;
+  if(list->count > 0) {
+    uint16_t size = list->object_size*(list->count);
+    void* temp_data = malloc(size);
+    memcpy(temp_data, list->data, size);
+    ret_list->data = temp_data;
+    ret_list->capacity = list->count;
+  }
   return ret_list;
 }
 
@@ -99,21 +148,10 @@ bool MemListRemove(MemList* list, uint16_t pos) {
     return false;
   }
   
-  void* temp_data = malloc(list->object_size*(list->count-1));
-  if(temp_data == NULL) {
-    return false;
-  }
-  
-  // copy beginning of list
-  memcpy(temp_data, list->data, (list->object_size)*pos);
- 
-  // copy end of list
-  memcpy(temp_data+(list->object_size)*(pos), 
-         list->data+(list->object_size)*(pos+1), 
-         list->object_size*(list->count-pos-1));
-
-  free(list->data);
-  list->data = temp_data;
+  // shift end of list over the removed object; the buffer is kept for reuse
+  memmove(list->data+(list->object_size)*(pos), 
+          list->data+(list->object_size)*(pos+1), 
+          list->object_size*(list->count-pos-1));
   list->count -= 1;
   
   return true;
@@ -7,12 +7,15 @@ typedef struct MemList {
   void* data;
   uint16_t object_size;
   uint16_t count;
+  uint16_t capacity;
 } MemList;
 
 MemList* MemListCreate(uint16_t size);
 void MemListClear(MemList* list);
 uint16_t MemListCount(const MemList* list);
 void* MemListGet(const MemList* list, uint16_t pos);
+bool MemListReserve(MemList* list, uint16_t capacity);
+bool MemListShrinkToFit(MemList* list);
 bool MemListAppend(MemList* list, void* object);
 bool MemListInsertAfter(MemList* list, void* object, uint16_t pos);
 MemList* MemListCopy(const MemList* list);
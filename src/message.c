@@ -0,0 +1,109 @@
+#include <pebble.h>
+#include "message.h"
+
+// dict_find() restarts its scan from the first tuple for every key, so
+// looking up each key costs keys * tuples; decoding visits each tuple once.
+
+// The phone sends all numbers as 32 bit integers, but accept any width
+static uint32_t TupleUint(const Tuple* tuple) {
+  switch(tuple->length) {
+    case 1:
+      return tuple->value->uint8;
+    case 2:
+      return tuple->value->uint16;
+    default:
+      return tuple->value->uint32;
+  }
+}
+
+static double TupleDouble(const Tuple* tuple) {
+  double value = 0;
+  if(tuple->length == sizeof(double)) {
+    memcpy(&value, tuple->value->data, sizeof(double));
+  }
+  return value;
+}
+
+void MessageDecode(DictionaryIterator* iterator, Message* message) {
+  memset(message, 0, sizeof(Message));
+
+  for(Tuple* t = dict_read_first(iterator); 
+      t != NULL; 
+      t = dict_read_next(iterator)) {
+    switch(t->key) {
+      case kAppMessageMessageType:
+        message->message_type = TupleUint(t);
+        break;
+      case kAppMessageTransactionId:
+        message->transaction_id = TupleUint(t);
+        break;
+      case kAppMessageItemsRemaining:
+        message->items_remaining = TupleUint(t);
+        break;
+      case kAppMessageIndex:
+        message->index = TupleUint(t);
+        break;
+      case kAppMessageCount:
+        message->count = TupleUint(t);
+        break;
+      case kAppMessageBaseTransactionId:
+        message->base_transaction_id = TupleUint(t);
+        break;
+      case kAppMessageSequence:
+        message->sequence = TupleUint(t);
+        break;
+      case kAppMessageStopId:
+        message->stop_id = t->value->cstring;
+        break;
+      case kAppMessageRouteId:
+        message->route_id = t->value->cstring;
+        break;
+      case kAppMessageStopName:
+        message->stop_name = t->value->cstring;
+        break;
+      case kAppMessageRouteName:
+        message->route_name = t->value->cstring;
+        break;
+      case kAppMessageRouteListString:
+        message->route_list_string = t->value->cstring;
+        break;
+      case kAppMessageDescription:
+        message->description = t->value->cstring;
+        break;
+      case kAppMessageDirection:
+        message->direction = t->value->cstring;
+        break;
+      case kAppMessageLat:
+        message->lat = TupleDouble(t);
+        break;
+      case kAppMessageLon:
+        message->lon = TupleDouble(t);
+        break;
+      case kAppMessageArrivalList:
+        if(t->type != TUPLE_BYTE_ARRAY) {
+          continue;
+        }
+        // read in place; no copy
+        message->arrival_list = (const ArrivalRecord*)t->value->data;
+        message->arrival_count = t->length / sizeof(ArrivalRecord);
+        break;
+      case kAppMessageBusFilter:
+        if(t->type != TUPLE_BYTE_ARRAY) {
+          continue;
+        }
+        message->bus_filter = t->value->data;
+        message->bus_filter_size = t->length;
+        break;
+      default:
+        // unused key
+        continue;
+    }
+    if(t->key < 32) {
+      message->present |= MESSAGE_KEY(t->key);
+    }
+  }
+}
+
+bool MessageHasKeys(const Message* message, const uint32_t keys) {
+  return (message->present & keys) == keys;
+}
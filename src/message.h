@@ -0,0 +1,60 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <pebble.h>
+#include "communication.h"
+
+// bit for an AppMessageKeys key in Message.present
+#define MESSAGE_KEY(key) ((uint32_t)1 << (key))
+
+// keys each message type must carry
+#define MESSAGE_REQUIRED_ARRIVAL_TIME \
+  (MESSAGE_KEY(kAppMessageCount) | MESSAGE_KEY(kAppMessageTransactionId) | \
+   MESSAGE_KEY(kAppMessageSequence))
+#define MESSAGE_REQUIRED_NEARBY_STOPS \
+  (MESSAGE_KEY(kAppMessageStopId) | MESSAGE_KEY(kAppMessageItemsRemaining) | \
+   MESSAGE_KEY(kAppMessageStopName) | \
+   MESSAGE_KEY(kAppMessageRouteListString) | MESSAGE_KEY(kAppMessageLat) | \
+   MESSAGE_KEY(kAppMessageLon) | MESSAGE_KEY(kAppMessageDirection) | \
+   MESSAGE_KEY(kAppMessageTransactionId) | MESSAGE_KEY(kAppMessageIndex) | \
+   MESSAGE_KEY(kAppMessageCount))
+#define MESSAGE_REQUIRED_NEARBY_ROUTES \
+  (MESSAGE_KEY(kAppMessageItemsRemaining) | MESSAGE_KEY(kAppMessageRouteId) | \
+   MESSAGE_KEY(kAppMessageRouteName) | MESSAGE_KEY(kAppMessageDescription) | \
+   MESSAGE_KEY(kAppMessageTransactionId))
+#define MESSAGE_REQUIRED_BUSES_SYNC \
+  MESSAGE_KEY(kAppMessageTransactionId)
+#define MESSAGE_REQUIRED_LOCATION \
+  (MESSAGE_KEY(kAppMessageLat) | MESSAGE_KEY(kAppMessageLon))
+
+// An inbound AppMessage, decoded in a single pass over the dictionary.
+// Strings and the arrival list point into the inbox; they're only valid
+// for the duration of the inbox callback.
+typedef struct {
+  uint32_t present;     // MESSAGE_KEY() bits of the keys found
+  uint32_t message_type;
+  uint32_t transaction_id;
+  uint32_t items_remaining;
+  uint32_t index;
+  uint32_t count;
+  uint32_t base_transaction_id;
+  uint32_t sequence;
+  const char* stop_id;
+  const char* route_id;
+  const char* stop_name;
+  const char* route_name;
+  const char* route_list_string;
+  const char* description;
+  const char* direction;
+  double lat;
+  double lon;
+  const ArrivalRecord* arrival_list;
+  uint16_t arrival_count;
+  const uint8_t* bus_filter;
+  uint16_t bus_filter_size;
+} Message;
+
+void MessageDecode(DictionaryIterator* iterator, Message* message);
+bool MessageHasKeys(const Message* message, const uint32_t keys);
+
+#endif // MESSAGE_H
@@ -1,6 +1,12 @@
 #include "persistence.h"
 #include "utility.h"
 
+// last known location, stored as a single record
+typedef struct {
+  sll lat;
+  sll lon;
+  int32_t fix_time;
+} __attribute__((__packed__)) PersistLocation;
 
 void PersistenceInit() {
   // write out the persistence version to enable later version control
@@ -95,7 +101,13 @@ void LoadBusesFromPersistence(Buses* buses) {
   buses->count = 0;
   buses->data = NULL;
   buses->filter_count = 0;
-  buses->filter_index = NULL;
+  buses->filter_bits = NULL;
+  buses->filter_words = 0;
+  buses->filter_radius = 0;
+  buses->filter_valid = false;
+  buses->hash_index = NULL;
+  buses->hash_size = 0;
+  buses->version = 0;
 
   if(PERSIST_DATA_MAX_LENGTH < sizeof(Bus)) {
     APP_LOG(APP_LOG_LEVEL_ERROR, 
@@ -141,6 +153,9 @@ void LoadBusesFromPersistence(Buses* buses) {
       APP_LOG(APP_LOG_LEVEL_ERROR, "NULL BUS POINTER");
     }
   }
+
+  BusesBuildIndex(buses);
+  BusesUpdateVersion(buses);
 }
 
 // void SaveBusesToPersistence(const Buses* buses) {
@@ -259,4 +274,106 @@ uint PersistReadSearchRadius() {
 
 bool PersistWriteSearchRadius(const uint32_t radius) {
   return PersistWriteInt(PERSIST_KEY_SEARCH_RADIUS, radius);
-}
\ No newline at end of file
+}
+
+bool PersistReadLocation(sll* lat, sll* lon, time_t* fix_time) {
+  PersistLocation location;
+  if(persist_read_data(PERSIST_KEY_LOCATION, 
+                       &location, 
+                       sizeof(PersistLocation)) != sizeof(PersistLocation)) {
+    return false;
+  }
+  *lat = location.lat;
+  *lon = location.lon;
+  *fix_time = location.fix_time;
+  return true;
+}
+
+bool PersistWriteLocation(const sll lat, const sll lon, const time_t fix_time) {
+  PersistLocation location = {
+    .lat = lat,
+    .lon = lon,
+    .fix_time = (int32_t)fix_time
+  };
+  return (0 < persist_write_data(PERSIST_KEY_LOCATION, 
+                                 &location, 
+                                 sizeof(PersistLocation)));
+}
+
+// Read the arrivals snapshot, aged by the time since it was fetched. Returns
+// false if there's no snapshot, it's too old to be shown, or it was taken
+// with different favorites (the bus indexes would be wrong).
+bool PersistReadArrivals(const Buses* buses, Arrivals* arrivals) {
+  if(!persist_exists(PERSIST_KEY_ARRIVALS_COUNT) ||
+     !persist_exists(PERSIST_KEY_ARRIVALS_TIME) ||
+     !persist_exists(PERSIST_KEY_ARRIVALS_BUSES_VERSION)) {
+    return false;
+  }
+  if((uint32_t)persist_read_int(PERSIST_KEY_ARRIVALS_BUSES_VERSION) != 
+     buses->version) {
+    return false;
+  }
+
+  int32_t age = time(NULL) - persist_read_int(PERSIST_KEY_ARRIVALS_TIME);
+  uint32_t count = persist_read_int(PERSIST_KEY_ARRIVALS_COUNT);
+  if((age < 0) || (age > PERSIST_ARRIVALS_MAX_AGE) || 
+     (count == 0) || (count > PERSIST_ARRIVALS_MAX)) {
+    return false;
+  }
+
+  Arrival chunk[PERSIST_ARRIVALS_PER_KEY];
+  for(uint32_t i = 0; i < count; i += PERSIST_ARRIVALS_PER_KEY) {
+    uint32_t n = count - i;
+    if(n > PERSIST_ARRIVALS_PER_KEY) {
+      n = PERSIST_ARRIVALS_PER_KEY;
+    }
+    int ret = persist_read_data(PERSIST_KEY_ARRIVALS + i/PERSIST_ARRIVALS_PER_KEY,
+                                chunk,
+                                sizeof(Arrival)*n);
+    if(ret != (int)(sizeof(Arrival)*n)) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, 
+              "Warning - arrivals snapshot read error @ %u",
+              (uint)i);
+      MemListClear(arrivals);
+      return false;
+    }
+
+    // the favorites may have changed since the snapshot was taken
+    for(uint32_t j = 0; j < n; j++) {
+      if(chunk[j].bus_index < buses->count) {
+        MemListAppend(arrivals, &chunk[j]);
+      }
+    }
+  }
+
+  ArrivalsAge(arrivals, age);
+  return (MemListCount(arrivals) > 0);
+}
+
+bool PersistWriteArrivals(const Buses* buses,
+                          const Arrivals* arrivals, 
+                          const time_t fetch_time) {
+  uint32_t count = MemListCount(arrivals);
+  if(count > PERSIST_ARRIVALS_MAX) {
+    // arrivals are sorted, so this keeps the soonest ones
+    count = PERSIST_ARRIVALS_MAX;
+  }
+
+  for(uint32_t i = 0; i < count; i += PERSIST_ARRIVALS_PER_KEY) {
+    uint32_t n = count - i;
+    if(n > PERSIST_ARRIVALS_PER_KEY) {
+      n = PERSIST_ARRIVALS_PER_KEY;
+    }
+    // arrivals are stored contiguously in the list
+    if(persist_write_data(PERSIST_KEY_ARRIVALS + i/PERSIST_ARRIVALS_PER_KEY,
+                          MemListGet(arrivals, i),
+                          sizeof(Arrival)*n) < 0) {
+      count = i;
+      break;
+    }
+  }
+
+  return PersistWriteInt(PERSIST_KEY_ARRIVALS_BUSES_VERSION, buses->version) &&
+         PersistWriteInt(PERSIST_KEY_ARRIVALS_TIME, fetch_time) &&
+         PersistWriteInt(PERSIST_KEY_ARRIVALS_COUNT, count);
+}
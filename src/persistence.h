@@ -3,6 +3,7 @@
 
 #include <pebble.h>
 #include "buses.h"
+#include "arrivals.h"
 
 #define PERSISTENCE_VERSION 1
 
@@ -11,6 +12,10 @@
 #define PERSIST_KEY_BUSES_COUNT 2
 #define PERSIST_KEY_ARRIVAL_RADIUS 3
 #define PERSIST_KEY_SEARCH_RADIUS 4
+#define PERSIST_KEY_LOCATION 5
+#define PERSIST_KEY_ARRIVALS_COUNT 6
+#define PERSIST_KEY_ARRIVALS_TIME 7
+#define PERSIST_KEY_ARRIVALS_BUSES_VERSION 8
 
 // note that this is incremented to store each bus (0@1000, 1@1000, etc.)
 #define PERSIST_KEY_BUSES 1000
@@ -20,10 +25,20 @@
 #define PERSIST_KEY_STOP_NAME 5000
 #define PERSIST_KEY_DIRECTION 6000
 #define PERSIST_KEY_DESCRIPTION 7000
+// arrivals snapshot, stored in chunks of PERSIST_ARRIVALS_PER_KEY
+#define PERSIST_KEY_ARRIVALS 8000
 
 #define DEFAULT_ARRIVAL_RADIUS 1000
 #define DEFAULT_SEARCH_RADIUS 300
 
+// how old (in seconds) a persisted location can be and still be used
+#define PERSIST_LOCATION_MAX_AGE (2*SECONDS_PER_HOUR)
+
+// the arrivals snapshot is kept small, and only shown if recent enough
+#define PERSIST_ARRIVALS_PER_KEY (PERSIST_DATA_MAX_LENGTH / sizeof(Arrival))
+#define PERSIST_ARRIVALS_MAX (2*PERSIST_ARRIVALS_PER_KEY)
+#define PERSIST_ARRIVALS_MAX_AGE (30*SECONDS_PER_MINUTE)
+
 void PersistenceInit();
 void LoadBusesFromPersistence(Buses* buses);
 bool SaveBusToPersistence(const Bus* bus, const uint i);
@@ -33,5 +48,11 @@ uint PersistReadArrivalRadius();
 bool PersistWriteArrivalRadius(const uint32_t radius);
 uint PersistReadSearchRadius();
 bool PersistWriteSearchRadius(const uint32_t radius);
+bool PersistReadLocation(sll* lat, sll* lon, time_t* fix_time);
+bool PersistWriteLocation(const sll lat, const sll lon, const time_t fix_time);
+bool PersistReadArrivals(const Buses* buses, Arrivals* arrivals);
+bool PersistWriteArrivals(const Buses* buses,
+                          const Arrivals* arrivals, 
+                          const time_t fetch_time);
 
 #endif //#PERSISTENCE_H
\ No newline at end of file
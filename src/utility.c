@@ -94,6 +94,16 @@ void FreeAndClearPointer(void** ptr) {
   *ptr = NULL;
 }
 
+// 32-bit FNV-1a hash of a string
+uint32_t StringHash(const char* string) {
+  uint32_t hash = 2166136261u;
+  while(*string != '\0') {
+    hash ^= (uint8_t)*string++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 void VibeMicroPulse() {
   static const uint32_t const segments[] = {50};
   VibePattern pat = {
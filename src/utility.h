@@ -22,6 +22,7 @@ void MenuCellDraw(GContext *ctx,
 void StringCopy(char* a, const char* b, uint s);
 bool StringAllocateAndCopy(char** a, const char* b);
 void FreeAndClearPointer(void** ptr);
+uint32_t StringHash(const char* string);
 void VibeMicroPulse();
 
 #endif /* end of include guard: UTILITY_H */